@@ -8,6 +8,35 @@
  ****************************************************************************/
 
 #include "16c550.h"
+#include "timers.h"
+#include "util.h"
+#include <string.h>
+#include <avr/interrupt.h>
+
+/// Ring buffer holding received characters. Filled by the UART pump.
+Ring uartRxRing;
+/// Ring buffer holding characters to send. Drained by the UART pump.
+Ring uartTxRing;
+
+/// Storage for uartRxRing
+static uint8_t rxBuf[UART_RX_RING_LEN];
+/// Storage for uartTxRing
+static uint8_t txBuf[UART_TX_RING_LEN];
+
+/// TRUE if the UART pump has been started
+static uint8_t pumpOn;
+/// Current baud rate
+static uint32_t baudRate;
+/// TRUE if hardware flow control is enabled
+static uint8_t flowCtrl;
+/// TRUE if #RTS has been deasserted by flow control
+static uint8_t rtsOff;
+/// TRUE if capture mode is enabled
+static uint8_t capture;
+/// Characters discarded in capture mode because uartRxRing was full
+static uint16_t capDropped;
+/// Line error counters
+static UartErrors lineErr;
 
 static int UartSprCheck(uint8_t value)
 {
@@ -19,6 +48,25 @@ static int UartSprCheck(uint8_t value)
 	return 0;
 }
 
+/************************************************************************//**
+ * \brief Reads the line status register, counting the reported errors.
+ *        Error bits are cleared when LSR is read, so the pump must read LSR
+ *        only through this function.
+ *
+ * \return The line status register value.
+ * \warning Must be called with interrupts disabled.
+ ****************************************************************************/
+static inline uint8_t UartLsrGet(void) {
+	uint8_t lsr = UartRead(UART_LSR);
+
+	if (lsr & 0x0E) {
+		if (lsr & 0x02) SatInc(lineErr.overrun);
+		if (lsr & 0x04) SatInc(lineErr.parity);
+		if (lsr & 0x08) SatInc(lineErr.framing);
+	}
+	return lsr;
+}
+
 /************************************************************************//**
  * \brief Initializes the driver. The baud rate is set to UART_BR, and the
  *        UART FIFOs are enabled. This function must be called before using
@@ -30,14 +78,23 @@ int8_t UartInit(void) {
 	UartWrite(UART_DLM, UART_DLM_VAL);
 	UartWrite(UART_DLL, UART_DLL_VAL);
 	UartWrite(UART_LCR, 0x03);
+	baudRate = UART_BR;
+	flowCtrl = rtsOff = capture = FALSE;
 
-	// Enable FIFOs
-	UartWrite(UART_FCR, 0x01);
+	// Enable FIFOs, and set RX trigger level
+	UartWrite(UART_FCR, 0x01 | UART_FCR_RX_TRIG);
 	// Reset FIFOs
-	UartWrite(UART_FCR, 0x07);
+	UartWrite(UART_FCR, 0x07 | UART_FCR_RX_TRIG);
 
-	// Ready to go! Interrupt and DMA modes were not configured since the
-	// Megadrive console lacks interrupt/DMA control pins on cart connector.
+	// Start with empty rings
+	RingInit(&uartRxRing, rxBuf, UART_RX_RING_LEN);
+	RingInit(&uartTxRing, txBuf, UART_TX_RING_LEN);
+
+	// Ready to go! DMA mode was not configured since the Megadrive console
+	// lacks interrupt/DMA control pins on cart connector. The RX data
+	// available interrupt is enabled only to get the FIFO trigger level
+	// reported in ISR, the interrupt line is not connected.
+	UartWrite(UART_IER, 0x01);
 
 	// Check if SPR writes are OK
 	if (UartSprCheck(0x00) ||
@@ -50,3 +107,283 @@ int8_t UartInit(void) {
 	return 0;
 }
 
+
+/************************************************************************//**
+ * \brief Checks if a baud rate can be generated from UART_CLK, with an
+ *        error lower than UART_BR_TOL_PCT.
+ *
+ * \param[in] baud Baud rate to check, in bits per second.
+ *
+ * \return The divisor value for the requested baud rate, or 0 if baud rate
+ *         is not supported.
+ ****************************************************************************/
+uint16_t UartBaudDivisor(uint32_t baud) {
+	uint32_t div;
+	uint32_t actual;
+
+	if (!baud) return 0;
+	div = DivWithRounding(UART_CLK, 16 * baud);
+	if (!div || div > 0xFFFF) return 0;
+	// Check error of the obtained baud rate
+	actual = UART_CLK / 16 / div;
+	if ((MAX(actual, baud) - MIN(actual, baud)) * 100 >
+			baud * UART_BR_TOL_PCT) return 0;
+
+	return div;
+}
+
+/************************************************************************//**
+ * \brief Changes the UART baud rate. Characters pending to be sent are
+ *        transmitted using the previous baud rate before the change.
+ *
+ * \param[in] baud Requested baud rate, in bits per second.
+ *
+ * \return 0 if baud rate was changed, 1 if requested baud rate can not be
+ *         generated from UART_CLK with an error lower than UART_BR_TOL_PCT.
+ ****************************************************************************/
+uint8_t UartBaudSet(uint32_t baud) {
+	uint16_t div;
+	uint8_t lsr;
+
+	if (!(div = UartBaudDivisor(baud))) return 1;
+
+	// Wait until pending characters have been completely sent
+	while (!UartTxDone()) UartPump();
+	do {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			lsr = UartLsrGet();
+		}
+	} while (!(lsr & 0x40));
+
+	// LCR[7] must be set to access DLX registers
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		UartWrite(UART_LCR, 0x83);
+		UartWrite(UART_DLM, div>>8);
+		UartWrite(UART_DLL, div & 0xFF);
+		UartWrite(UART_LCR, 0x03);
+	}
+	baudRate = baud;
+
+	return 0;
+}
+
+/************************************************************************//**
+ * \brief Obtains the current UART baud rate.
+ *
+ * \return The baud rate requested on last successful UartBaudSet() call, or
+ *         UART_BR if baud rate has not been changed since UartInit().
+ ****************************************************************************/
+uint32_t UartBaudGet(void) {
+	return baudRate;
+}
+
+/************************************************************************//**
+ * \brief Moves characters between the UART FIFOs and the ring buffers.
+ *
+ * \warning Must be called with interrupts disabled.
+ ****************************************************************************/
+static inline void UartPumpCycle(void) {
+	uint8_t tmp[UART_FIFO_LENGTH];
+	uint8_t i, n;
+
+	// Drain RX FIFO in bursts while trigger level is reached, then get the
+	// tail polling LSR. Characters are left in the FIFO if ring fills.
+	// Parity and framing bits only apply to the character on top of the
+	// FIFO, so if there is an error somewhere in the FIFO (LSR bit 7),
+	// the burst is read character by character to count every error.
+	while ((RingFree(&uartRxRing) >= UART_RX_TRIG_LEVEL) &&
+			UartRxTrigReached()) {
+		if (UartLsrGet() & 0x80) {
+			for (i = 0; i < UART_RX_TRIG_LEVEL; i++) {
+				UartLsrGet();
+				RingPut(&uartRxRing, UartGetchar());
+			}
+		} else {
+			UartReadBurst(UART_RHR, tmp, UART_RX_TRIG_LEVEL);
+			for (i = 0; i < UART_RX_TRIG_LEVEL; i++)
+				RingPut(&uartRxRing, tmp[i]);
+		}
+	}
+	for (n = UART_FIFO_LENGTH; n && !RingFull(&uartRxRing) &&
+			(UartLsrGet() & 0x01); n--) {
+		RingPut(&uartRxRing, UartGetchar());
+	}
+	// In capture mode, keep the FIFO draining even if the ring is full.
+	// Characters that do not fit are discarded and counted.
+	if (capture) {
+		for (n = UART_FIFO_LENGTH; n && RingFull(&uartRxRing) &&
+				(UartLsrGet() & 0x01); n--) {
+			UartGetchar();
+			if (capDropped < UINT16_MAX) capDropped++;
+		}
+	}
+
+	// Stop the peer before the RX ring overflows, and let it go on when
+	// the main loop has consumed enough characters.
+	if (flowCtrl) {
+		n = RingFree(&uartRxRing);
+		if (!rtsOff && n < UART_RTS_OFF_FREE) {
+			UartWrite(UART_MCR, UartRead(UART_MCR) & ~0x02);
+			rtsOff = TRUE;
+		} else if (rtsOff && n >= UART_RTS_ON_FREE) {
+			UartWrite(UART_MCR, UartRead(UART_MCR) | 0x02);
+			rtsOff = FALSE;
+		}
+	}
+
+	// Fill TX FIFO if empty and there is data pending. With flow control
+	// enabled, wait until peer asserts #CTS.
+	if (!RingEmpty(&uartTxRing) && (UartLsrGet() & 0x20) &&
+			(!flowCtrl || !UartCtsGet())) {
+		n = MIN(RingCount(&uartTxRing), UART_FIFO_LENGTH);
+		for (i = 0; i < n; i++) tmp[i] = RingGet(&uartTxRing);
+		UartWriteBurst(UART_THR, tmp, n);
+	}
+}
+
+/// UART pump, periodically run by Timer0
+ISR(TIMER0_COMPA_vect) {
+	UartPumpCycle();
+}
+
+/************************************************************************//**
+ * \brief Starts the UART pump. The pump runs periodically from the Timer0
+ *        interrupt, moving received characters from the RX FIFO to
+ *        uartRxRing, and characters from uartTxRing to the TX FIFO.
+ ****************************************************************************/
+void UartPumpStart(void) {
+	pumpOn = TRUE;
+	Timer0PeriodicStart(Timer0UsToCount(UART_PUMP_PERIOD_US));
+}
+
+/************************************************************************//**
+ * \brief Stops the UART pump.
+ ****************************************************************************/
+void UartPumpStop(void) {
+	pumpOn = FALSE;
+	Timer0Stop();
+}
+
+/************************************************************************//**
+ * \brief Pauses the UART pump (if started), to let other chips use the bus.
+ ****************************************************************************/
+void UartPumpPause(void) {
+	Timer0IntDisable();
+}
+
+/************************************************************************//**
+ * \brief Resumes the UART pump, if it was paused by UartPumpPause().
+ ****************************************************************************/
+void UartPumpResume(void) {
+	if (pumpOn) Timer0IntEnable();
+}
+
+/************************************************************************//**
+ * \brief Checks if the UART pump has been started.
+ *
+ * \return TRUE if pump has been started (even if paused), FALSE otherwise.
+ ****************************************************************************/
+uint8_t UartPumpRunning(void) {
+	return pumpOn;
+}
+
+/************************************************************************//**
+ * \brief Runs a pump cycle if the pump is paused and a pump period has
+ *        elapsed. Code holding the bus with the pump paused (e.g. while
+ *        polling the flash chip status) can call this between bus accesses,
+ *        to keep the UART serviced at the same rate as the pump interrupt.
+ ****************************************************************************/
+void UartPumpYield(void) {
+	if (pumpOn && Timer0Match()) UartPump();
+}
+
+/************************************************************************//**
+ * \brief Enables or disables capture mode. In capture mode, the pump keeps
+ *        draining the RX FIFO when uartRxRing is full, discarding the
+ *        characters that do not fit, so the FIFO never overruns and lost
+ *        characters can be counted. The discarded characters counter is
+ *        reset.
+ *
+ * \param[in] enable TRUE to enable capture mode, FALSE to disable it.
+ ****************************************************************************/
+void UartCaptureSet(uint8_t enable) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		capture = enable;
+		capDropped = 0;
+	}
+}
+
+/************************************************************************//**
+ * \brief Checks if capture mode is enabled.
+ *
+ * \return TRUE if capture mode is enabled, FALSE otherwise.
+ ****************************************************************************/
+uint8_t UartCaptureOn(void) {
+	return capture;
+}
+
+/************************************************************************//**
+ * \brief Obtains the number of characters discarded in capture mode, and
+ *        resets the counter.
+ *
+ * \return Characters discarded since last call (saturates at UINT16_MAX).
+ ****************************************************************************/
+uint16_t UartCaptureDropped(void) {
+	uint16_t dropped;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		dropped = capDropped;
+		capDropped = 0;
+	}
+	return dropped;
+}
+
+/************************************************************************//**
+ * \brief Obtains the line error counters. Errors are detected when the
+ *        UART pump reads the line status register.
+ *
+ * \param[out] err   Line error counters.
+ * \param[in]  clear If TRUE, counters are reset after reading them.
+ ****************************************************************************/
+void UartErrorsGet(UartErrors *err, uint8_t clear) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*err = lineErr;
+		if (clear) memset(&lineErr, 0, sizeof(UartErrors));
+	}
+}
+
+/************************************************************************//**
+ * \brief Runs a UART pump cycle right now. Can be called from the main loop
+ *        to service the UART without waiting for the next pump interrupt.
+ ****************************************************************************/
+void UartPump(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		UartPumpCycle();
+	}
+}
+
+/************************************************************************//**
+ * \brief Resets the RX FIFO, and discards characters in uartRxRing.
+ ****************************************************************************/
+void UartFlush(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		UartWrite(UART_FCR, 0x03 | UART_FCR_RX_TRIG);
+		RingFlush(&uartRxRing);
+	}
+}
+
+/************************************************************************//**
+ * \brief Enables or disables hardware (#RTS/#CTS) flow control. When
+ *        enabled, the pump only fills the TX FIFO while #CTS is active, and
+ *        deasserts #RTS when uartRxRing is nearly full. #RTS is left active
+ *        when flow control is disabled.
+ *
+ * \param[in] enable TRUE to enable flow control, FALSE to disable it.
+ ****************************************************************************/
+void UartFlowCtrlSet(uint8_t enable) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		flowCtrl = enable;
+		rtsOff = FALSE;
+		UartClrRts();
+	}
+}
@@ -13,7 +13,9 @@
 #define _16C550_H_
 
 #include <stdint.h>
+#include <util/atomic.h>
 #include "cart_if.h"
+#include "ring.h"
 
 /// Clock applied to 16C550 chip (same as avr chip, 8 MHz)
 //#define UART_CLK		14745600LU
@@ -31,9 +33,49 @@
 //#define UART_BR			750000LU
 //#define UART_BR				1500000LU	// Fails with 24 MHz XTAL!
 
+/// Maximum baud rate error allowed by UartBaudSet(), in percent.
+#define UART_BR_TOL_PCT		3
+
 /// Lenght of the UART TX and RX FIFOs in characters
 #define UART_FIFO_LENGTH	16
 
+/// RX FIFO trigger level in characters (1, 4, 8 or 14). When the RX FIFO
+/// holds at least this number of characters, UartRxTrigReached() evaluates
+/// to TRUE and the characters can be read in a burst without polling LSR.
+#define UART_RX_TRIG_LEVEL	8
+
+/// FCR bits selecting the RX FIFO trigger level
+#if UART_RX_TRIG_LEVEL == 1
+#define UART_FCR_RX_TRIG	0x00
+#elif UART_RX_TRIG_LEVEL == 4
+#define UART_FCR_RX_TRIG	0x40
+#elif UART_RX_TRIG_LEVEL == 8
+#define UART_FCR_RX_TRIG	0x80
+#elif UART_RX_TRIG_LEVEL == 14
+#define UART_FCR_RX_TRIG	0xC0
+#else
+#error "UART_RX_TRIG_LEVEL must be 1, 4, 8 or 14"
+#endif
+
+/// Length of the SRAM ring buffer holding received characters (power of 2,
+/// up to 256).
+#define UART_RX_RING_LEN	256
+/// Length of the SRAM ring buffer holding characters pending to be sent
+/// (power of 2, up to 256).
+#define UART_TX_RING_LEN	128
+
+/// When flow control is enabled, #RTS is deasserted if free space in the RX
+/// ring drops below this value. Must leave room for the characters in the
+/// RX FIFO plus the ones the peer sends before stopping.
+#define UART_RTS_OFF_FREE	32
+/// When flow control is enabled, #RTS is asserted again once free space in
+/// the RX ring reaches this value.
+#define UART_RTS_ON_FREE	96
+
+/// Period of the UART pump, in microseconds. At 500 kbps, it takes 320 us
+/// for the RX FIFO to overflow, so the pump must run quite faster.
+#define UART_PUMP_PERIOD_US	200
+
 /// Division with one bit rounding, useful for divisor calculations.
 #define DivWithRounding(dividend, divisor)	((((dividend)*2/(divisor))+1)/2)
 /// Value to load on the UART divisor, high byte
@@ -136,6 +178,88 @@ static inline uint8_t UartRead(uint8_t addr) {
 	return data;
 }
 
+/************************************************************************//**
+ * \brief Writes several bytes to the same Uart register (in the #TIME
+ *        range). The register address is latched only once, and then a
+ *        #TIME/#W cycle is generated for each byte, so this is considerably
+ *        faster than calling UartWrite() for each byte.
+ *
+ * \param[in] addr Address to which data will be written. Only the lower 8
+ *            bits are used.
+ * \param[in] data Buffer with the data to write.
+ * \param[in] len  Number of bytes to write.
+ *
+ * \note Intended for loading the TX FIFO through UART_THR. Caller must
+ *       make sure there is room for len characters.
+ ****************************************************************************/
+static inline void UartWriteBurst(uint8_t addr, const uint8_t *data,
+		uint8_t len) {
+	// Generate address strobe and put address on the bus
+	CIF_CLR__AS;
+	CIF_ADDRL_PORT = addr;
+	CIF_SET__AS;
+	// Drive the data bus during the complete burst
+	CIF_DATAL_DDR = 0xFF;
+	while (len--) {
+		// Write data to bus
+		CIF_DATAL_PORT = *data++;
+		// Select chip and signal _W
+		CIF_CLR__TIME;
+		CIF_CLR__W;
+		// Disable _W and deselect chip
+		CIF_SET__W;
+		CIF_SET__TIME;
+	}
+	// Remove data from bus
+	CIF_DATAL_DDR  = 0;
+	CIF_DATAL_PORT = 0xFF;
+}
+
+/************************************************************************//**
+ * \brief Reads several bytes from the same Uart register (in the #TIME
+ *        range). The register address is latched only once, and then a
+ *        #TIME/#OE cycle is generated for each byte.
+ *
+ * \param[in]  addr Address that will be read.
+ * \param[out] data Buffer where read data will be stored.
+ * \param[in]  len  Number of bytes to read.
+ *
+ * \note Intended for draining the RX FIFO through UART_RHR. Caller must
+ *       make sure there are at least len characters available.
+ ****************************************************************************/
+static inline void UartReadBurst(uint8_t addr, uint8_t *data, uint8_t len) {
+	// Generate address strobe and put address on the bus
+	CIF_CLR__AS;
+	CIF_ADDRL_PORT = addr;
+	CIF_SET__AS;
+	while (len--) {
+		// Select chip and enable chip outputs
+		CIF_CLR__TIME;
+		CIF_CLR__OE;
+		// Read data
+		_NOP();
+		_NOP();
+		*data++ = CIF_DATAL_PIN;
+		// Disable chip outputs and deselect chip
+		CIF_SET__OE;
+		CIF_SET__TIME;
+	}
+}
+
+/// Ring buffer holding received characters. Filled by the UART pump.
+extern Ring uartRxRing;
+/// Ring buffer holding characters to send. Drained by the UART pump.
+extern Ring uartTxRing;
+
+/** \addtogroup 16c550 UartErrors Line error counters.
+ *  \{ */
+typedef struct {
+	uint16_t overrun;	///< Overrun errors (RX FIFO full).
+	uint16_t parity;	///< Parity errors.
+	uint16_t framing;	///< Framing errors.
+} UartErrors;
+/** \} */
+
 /************************************************************************//**
  * \brief Initializes the driver. The baud rate is set to UART_BR, and the
  *        UART FIFOs are enabled. This function must be called before using
@@ -145,6 +269,144 @@ static inline uint8_t UartRead(uint8_t addr) {
  ****************************************************************************/
 int8_t UartInit(void);
 
+/************************************************************************//**
+ * \brief Checks if a baud rate can be generated from UART_CLK, with an
+ *        error lower than UART_BR_TOL_PCT.
+ *
+ * \param[in] baud Baud rate to check, in bits per second.
+ *
+ * \return The divisor value for the requested baud rate, or 0 if baud rate
+ *         is not supported.
+ ****************************************************************************/
+uint16_t UartBaudDivisor(uint32_t baud);
+
+/************************************************************************//**
+ * \brief Changes the UART baud rate. Characters pending to be sent are
+ *        transmitted using the previous baud rate before the change.
+ *
+ * \param[in] baud Requested baud rate, in bits per second.
+ *
+ * \return 0 if baud rate was changed, 1 if requested baud rate can not be
+ *         generated from UART_CLK with an error lower than UART_BR_TOL_PCT.
+ ****************************************************************************/
+uint8_t UartBaudSet(uint32_t baud);
+
+/************************************************************************//**
+ * \brief Obtains the current UART baud rate.
+ *
+ * \return The baud rate requested on last successful UartBaudSet() call, or
+ *         UART_BR if baud rate has not been changed since UartInit().
+ ****************************************************************************/
+uint32_t UartBaudGet(void);
+
+/************************************************************************//**
+ * \brief Starts the UART pump. The pump runs periodically from the Timer0
+ *        interrupt, moving received characters from the RX FIFO to
+ *        uartRxRing, and characters from uartTxRing to the TX FIFO.
+ *
+ * \note The UART and the flash chip share the cart bus. The pump must be
+ *       paused using UartPumpPause() while accessing the flash chip.
+ * \warning Once the pump has been started, UART registers must not be
+ *       accessed from the main loop without disabling interrupts.
+ ****************************************************************************/
+void UartPumpStart(void);
+
+/************************************************************************//**
+ * \brief Stops the UART pump.
+ ****************************************************************************/
+void UartPumpStop(void);
+
+/************************************************************************//**
+ * \brief Pauses the UART pump (if started), to let other chips use the bus.
+ ****************************************************************************/
+void UartPumpPause(void);
+
+/************************************************************************//**
+ * \brief Resumes the UART pump, if it was paused by UartPumpPause().
+ ****************************************************************************/
+void UartPumpResume(void);
+
+/************************************************************************//**
+ * \brief Checks if the UART pump has been started.
+ *
+ * \return TRUE if pump has been started (even if paused), FALSE otherwise.
+ ****************************************************************************/
+uint8_t UartPumpRunning(void);
+
+/************************************************************************//**
+ * \brief Runs a pump cycle if the pump is paused and a pump period has
+ *        elapsed. Code holding the bus with the pump paused (e.g. while
+ *        polling the flash chip status) can call this between bus accesses,
+ *        to keep the UART serviced at the same rate as the pump interrupt.
+ ****************************************************************************/
+void UartPumpYield(void);
+
+/************************************************************************//**
+ * \brief Enables or disables capture mode. In capture mode, the pump keeps
+ *        draining the RX FIFO when uartRxRing is full, discarding the
+ *        characters that do not fit, so the FIFO never overruns and lost
+ *        characters can be counted. The discarded characters counter is
+ *        reset.
+ *
+ * \param[in] enable TRUE to enable capture mode, FALSE to disable it.
+ ****************************************************************************/
+void UartCaptureSet(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Checks if capture mode is enabled.
+ *
+ * \return TRUE if capture mode is enabled, FALSE otherwise.
+ ****************************************************************************/
+uint8_t UartCaptureOn(void);
+
+/************************************************************************//**
+ * \brief Obtains the number of characters discarded in capture mode, and
+ *        resets the counter.
+ *
+ * \return Characters discarded since last call (saturates at UINT16_MAX).
+ ****************************************************************************/
+uint16_t UartCaptureDropped(void);
+
+/************************************************************************//**
+ * \brief Obtains the line error counters. Errors are detected when the
+ *        UART pump reads the line status register.
+ *
+ * \param[out] err   Line error counters.
+ * \param[in]  clear If TRUE, counters are reset after reading them.
+ ****************************************************************************/
+void UartErrorsGet(UartErrors *err, uint8_t clear);
+
+/************************************************************************//**
+ * \brief Runs a UART pump cycle right now. Can be called from the main loop
+ *        to service the UART without waiting for the next pump interrupt.
+ ****************************************************************************/
+void UartPump(void);
+
+/************************************************************************//**
+ * \brief Resets the RX FIFO, and discards characters in uartRxRing.
+ ****************************************************************************/
+void UartFlush(void);
+
+/************************************************************************//**
+ * \brief Enables or disables hardware (#RTS/#CTS) flow control. When
+ *        enabled, the pump only fills the TX FIFO while #CTS is active, and
+ *        deasserts #RTS when uartRxRing is nearly full. #RTS is left active
+ *        when flow control is disabled.
+ *
+ * \param[in] enable TRUE to enable flow control, FALSE to disable it.
+ *
+ * \note Flow control is disabled by UartInit().
+ ****************************************************************************/
+void UartFlowCtrlSet(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Checks if all the characters in uartTxRing have been moved to the
+ *        TX FIFO.
+ *
+ * \return TRUE if uartTxRing is empty, FALSE otherwise.
+ ****************************************************************************/
+#define UartTxDone()	RingEmpty(&uartTxRing)
+
 /************************************************************************//**
  * \brief Checks if UART transmit register/FIFO is ready. In FIFO mode, up to
  *        16 characters can be loaded each time transmitter is ready.
@@ -160,6 +422,17 @@ int8_t UartInit(void);
  ****************************************************************************/
 #define UartRxReady()	(UartRead(UART_LSR) & 0x01)
 
+/************************************************************************//**
+ * \brief Checks if the RX FIFO trigger level has been reached, using the
+ *        interrupt status register. Only the RX data available interrupt is
+ *        enabled by UartInit(), so when this is reported, at least
+ *        UART_RX_TRIG_LEVEL characters can be read without polling LSR.
+ *
+ * \return TRUE if at least UART_RX_TRIG_LEVEL characters are available,
+ *         FALSE otherwise.
+ ****************************************************************************/
+#define UartRxTrigReached()	((UartRead(UART_ISR) & 0x0F) == 0x04)
+
 /************************************************************************//**
  * \brief Sends a character. Please make sure there is room in the transmit
  *        register/FIFO by calling UartRxReady() before using this function.
@@ -182,16 +455,24 @@ int8_t UartInit(void);
  *
  * \param[in] reg  Register that will be modified.
  * \param[in] mask Bit mask. Bits at '1' will be set on reg.
+ *
+ * \note Access is done with interrupts disabled, to avoid interfering with
+ *       the UART pump.
  ****************************************************************************/
-#define UartSet(reg, mask)	do{UartWrite(reg, UartRead(reg)| mask);}while(0)
+#define UartSet(reg, mask)	do{ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
+	UartWrite(reg, UartRead(reg)| mask);}}while(0)
 
 /************************************************************************//**
  * \brief Clears bits specified by mask on specified register.
  *
  * \param[in] reg  Register that will be modified.
  * \param[in] mask Bit mask. Bits at '1' will be clear on reg.
+ *
+ * \note Access is done with interrupts disabled, to avoid interfering with
+ *       the UART pump.
  ****************************************************************************/
-#define UartClr(reg, mask)	do{UartWrite(reg, UartRead(reg)&~mask);}while(0)
+#define UartClr(reg, mask)	do{ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		\
+	UartWrite(reg, UartRead(reg)&~mask);}}while(0)
 
 /************************************************************************//**
  * \brief Sets (output high) #DTR UART pin.
@@ -238,14 +519,14 @@ int8_t UartInit(void);
  *
  * \return 0 if pin active, non-zero otherwise.
  ****************************************************************************/
-#define UartCtsGet()	(UartRead(UART_LCR) & 0x10)
+#define UartCtsGet()	(~UartRead(UART_MSR) & 0x10)
 
 /************************************************************************//**
  * \brief Obtains the #DSR (active low) pin status.
  *
  * \return 0 if pin active, non-zero otherwise.
  ****************************************************************************/
-#define UartDsrGet()	(UartRead(UART_LCR) & 0x20)
+#define UartDsrGet()	(~UartRead(UART_MSR) & 0x20)
 
 /************************************************************************//**
  * \brief Returns the TX FIFO status (empty/not empty).
@@ -261,11 +542,6 @@ int8_t UartInit(void);
  ****************************************************************************/
 #define UartRxFifoData()	(UartRead(UART_LSR) & 0x01)
 
-/************************************************************************//**
- * \brief Resets UART FIFOs, removing pending characters to send/receive.
- ****************************************************************************/
-#define UartFlush()			do{UartWrite(UART_FCR, 0x03);}while(0)
-
 #endif //_16C550_H_
 
 /** \} */
@@ -60,6 +60,21 @@
 		#define VENDOR_O_EPSIZE               64
 		//#define VENDOR_IO_EPSIZE               (32 + 6)
 
+		/** Endpoint address of the CDC device-to-host notification IN endpoint. */
+		#define CDC_NOTIFICATION_EPADDR        (ENDPOINT_DIR_IN  | 2)
+
+		/** Endpoint address of the CDC device-to-host data IN endpoint. */
+		#define CDC_TX_EPADDR                  (ENDPOINT_DIR_IN  | 5)
+
+		/** Endpoint address of the CDC host-to-device data OUT endpoint. */
+		#define CDC_RX_EPADDR                  (ENDPOINT_DIR_OUT | 6)
+
+		/** Size in bytes of the CDC device-to-host notification IN endpoint. */
+		#define CDC_NOTIFICATION_EPSIZE        8
+
+		/** Size in bytes of the CDC data IN and OUT endpoints. */
+		#define CDC_TXRX_EPSIZE                64
+
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
@@ -73,6 +88,19 @@
 			USB_Descriptor_Interface_t            Vendor_Interface;
 			USB_Descriptor_Endpoint_t             Vendor_DataInEndpoint;
 			USB_Descriptor_Endpoint_t             Vendor_DataOutEndpoint;
+
+			// CDC Control Interface (WiFi UART bridge)
+			USB_Descriptor_Interface_Association_t CDC_IAD;
+			USB_Descriptor_Interface_t            CDC_CCI_Interface;
+			USB_CDC_Descriptor_FunctionalHeader_t CDC_Functional_Header;
+			USB_CDC_Descriptor_FunctionalACM_t    CDC_Functional_ACM;
+			USB_CDC_Descriptor_FunctionalUnion_t  CDC_Functional_Union;
+			USB_Descriptor_Endpoint_t             CDC_NotificationEndpoint;
+
+			// CDC Data Interface (WiFi UART bridge)
+			USB_Descriptor_Interface_t            CDC_DCI_Interface;
+			USB_Descriptor_Endpoint_t             CDC_DataOutEndpoint;
+			USB_Descriptor_Endpoint_t             CDC_DataInEndpoint;
 		} USB_Descriptor_Configuration_t;
 
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -81,7 +109,9 @@
 		 */
 		enum InterfaceDescriptors_t
 		{
-			INTERFACE_ID_Vendor = 0, /**< Vendor interface descriptor ID */
+			INTERFACE_ID_Vendor  = 0, /**< Vendor interface descriptor ID */
+			INTERFACE_ID_CDC_CCI = 1, /**< CDC CCI interface descriptor ID */
+			INTERFACE_ID_CDC_DCI = 2, /**< CDC DCI interface descriptor ID */
 		};
 
 		/** Enum for the device string descriptor IDs within the device. Each string descriptor should
@@ -0,0 +1,119 @@
+/************************************************************************//**
+ * \file
+ * \brief USB CDC-ACM interface bridging the WiFi module UART to the host.
+ * While the host asserts DTR, characters received from the host are sent
+ * through the UART, and characters received from the UART are sent to the
+ * host. Baud rate follows the line coding set by the host.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+
+#include "cdc-bridge.h"
+#include "16c550.h"
+#include "util.h"
+#include <Descriptors.h>
+#include <util/atomic.h>
+
+/// LUFA CDC class driver interface configuration and state
+static USB_ClassInfo_CDC_Device_t cdcIf = {
+	.Config = {
+		.ControlInterfaceNumber = INTERFACE_ID_CDC_CCI,
+		.DataINEndpoint = {
+			.Address = CDC_TX_EPADDR,
+			.Size    = CDC_TXRX_EPSIZE,
+			.Banks   = 1,
+		},
+		.DataOUTEndpoint = {
+			.Address = CDC_RX_EPADDR,
+			.Size    = CDC_TXRX_EPSIZE,
+			.Banks   = 1,
+		},
+		.NotificationEndpoint = {
+			.Address = CDC_NOTIFICATION_EPADDR,
+			.Size    = CDC_NOTIFICATION_EPSIZE,
+			.Banks   = 1,
+		},
+	},
+};
+
+/// TRUE if the bridge is active
+static uint8_t bridgeOn;
+
+/************************************************************************//**
+ * \brief Configures the CDC interface endpoints. Must be called when the
+ *        USB configuration changes.
+ *
+ * \return TRUE if endpoints were configured, FALSE otherwise.
+ ****************************************************************************/
+uint8_t CdcBridgeConfigure(void) {
+	bridgeOn = FALSE;
+	return CDC_Device_ConfigureEndpoints(&cdcIf);
+}
+
+/************************************************************************//**
+ * \brief Processes control requests directed to the CDC interface. Must be
+ *        called from the USB control request event.
+ ****************************************************************************/
+void CdcBridgeControlRequest(void) {
+	CDC_Device_ProcessControlRequest(&cdcIf);
+}
+
+/************************************************************************//**
+ * \brief Moves data between the CDC endpoints and the UART rings. Must be
+ *        called periodically from the main loop.
+ ****************************************************************************/
+void CdcBridgeTask(void) {
+	uint32_t baud;
+	uint8_t dtr;
+	int16_t c;
+
+	// Line state and coding are updated by the control request handler,
+	// that runs in interrupt context.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		dtr = cdcIf.State.ControlLineStates.HostToDevice &
+			CDC_CONTROL_LINE_OUT_DTR;
+		baud = cdcIf.State.LineEncoding.BaudRateBPS;
+	}
+
+	// Capture mode and the bridge are mutually exclusive: both consume
+	// uartRxRing.
+	if (!dtr || !UartPumpRunning() || UartCaptureOn()) {
+		bridgeOn = FALSE;
+		return;
+	}
+	if (!bridgeOn) {
+		// Bridge activated, discard stale received data
+		UartFlush();
+		bridgeOn = TRUE;
+	}
+	// Follow host baud rate. Unsupported rates are ignored.
+	if (baud && (baud != UartBaudGet())) UartBaudSet(baud);
+
+	// Host to UART
+	while (!RingFull(&uartTxRing) && ((c = CDC_Device_ReceiveByte(&cdcIf))
+				>= 0)) {
+		RingPut(&uartTxRing, c);
+	}
+	// UART to host. Never wait for the endpoint: if the host does not read
+	// data, characters are left in the ring.
+	Endpoint_SelectEndpoint(CDC_TX_EPADDR);
+	if (Endpoint_IsINReady()) {
+		while (!RingEmpty(&uartRxRing) && Endpoint_IsReadWriteAllowed())
+			Endpoint_Write_8(RingGet(&uartRxRing));
+		// Send full bank now, partial banks are flushed below
+		if (!Endpoint_IsReadWriteAllowed()) Endpoint_ClearIN();
+	}
+	CDC_Device_USBTask(&cdcIf);
+}
+
+/************************************************************************//**
+ * \brief Checks if the bridge is active (host asserted DTR, the UART pump
+ *        is running and capture mode is off). While active, the bridge
+ *        owns the UART.
+ *
+ * \return TRUE if bridge is active, FALSE otherwise.
+ ****************************************************************************/
+uint8_t CdcBridgeActive(void) {
+	return bridgeOn;
+}
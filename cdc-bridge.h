@@ -0,0 +1,51 @@
+/************************************************************************//**
+ * \file
+ * \brief USB CDC-ACM interface bridging the WiFi module UART to the host.
+ * While the host asserts DTR, characters received from the host are sent
+ * through the UART, and characters received from the UART are sent to the
+ * host. Baud rate follows the line coding set by the host.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ * \defgroup cdc-bridge USB CDC to WiFi UART bridge.
+ * \{
+ ****************************************************************************/
+
+#ifndef _CDC_BRIDGE_H_
+#define _CDC_BRIDGE_H_
+
+#include <stdint.h>
+
+/************************************************************************//**
+ * \brief Configures the CDC interface endpoints. Must be called when the
+ *        USB configuration changes.
+ *
+ * \return TRUE if endpoints were configured, FALSE otherwise.
+ ****************************************************************************/
+uint8_t CdcBridgeConfigure(void);
+
+/************************************************************************//**
+ * \brief Processes control requests directed to the CDC interface. Must be
+ *        called from the USB control request event.
+ ****************************************************************************/
+void CdcBridgeControlRequest(void);
+
+/************************************************************************//**
+ * \brief Moves data between the CDC endpoints and the UART rings. Must be
+ *        called periodically from the main loop.
+ ****************************************************************************/
+void CdcBridgeTask(void);
+
+/************************************************************************//**
+ * \brief Checks if the bridge is active (host asserted DTR, the UART pump
+ *        is running and capture mode is off). While active, the bridge
+ *        owns the UART.
+ *
+ * \return TRUE if bridge is active, FALSE otherwise.
+ ****************************************************************************/
+uint8_t CdcBridgeActive(void);
+
+#endif /*_CDC_BRIDGE_H_*/
+
+/** \} */
+
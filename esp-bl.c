@@ -0,0 +1,764 @@
+/************************************************************************//**
+ * \file
+ * \brief ESP8266 ROM bootloader protocol handling. Commands are sent and
+ * replies received through the SLIP framing layer.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+
+#include "esp-bl.h"
+#include "slip.h"
+#include "16c550.h"
+#include "wifi-if.h"
+#include "util.h"
+#include "timers.h"
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <LUFA/Drivers/USB/USB.h>
+#ifdef ESP_STUB_HDR
+#include ESP_STUB_HDR
+#endif
+
+/// Time to wait after requesting a baud rate change, before reprogramming
+/// the UART, in milliseconds.
+#define ESP_BL_BAUD_SETTLE_MS	50
+
+/// Time the module is held in reset when entering the bootloader, in
+/// milliseconds.
+#define ESP_BL_BOOT_RST_MS		10
+
+/// Time from reset release to the bootloader being ready, in milliseconds.
+/// The ROM prints a boot message at 74880 bps during this time.
+#define ESP_BL_BOOT_READY_MS	50
+
+/// Payload of the SYNC command.
+static const uint8_t syncData[] = {
+	0x07, 0x07, 0x12, 0x20,
+	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55
+};
+
+/// Buffer holding the last received reply
+static uint8_t rep[ESP_BL_REPLY_MAX];
+/// Length of the payload of the last received reply
+static uint16_t repDataLen;
+/// TRUE if the flasher stub is running
+static uint8_t stubOn;
+
+/************************************************************************//**
+ * \brief Writes a dword using little endian order.
+ *
+ * \param[out] dest Destination buffer.
+ * \param[in]  src  Dword to write.
+ ****************************************************************************/
+static void EspBlDwordPut(uint8_t dest[], uint32_t src) {
+	dest[0] = src;
+	dest[1] = src>>8;
+	dest[2] = src>>16;
+	dest[3] = src>>24;
+}
+
+/************************************************************************//**
+ * \brief Resets module state. Must be called each time the WiFi module or
+ *        the UART are reset.
+ ****************************************************************************/
+void EspBlInit(void) {
+	stubOn = FALSE;
+}
+
+/************************************************************************//**
+ * \brief Sends a command frame to the bootloader. Payload can be split in
+ *        two buffers, to avoid copying data blocks.
+ *
+ * \param[in] cmd     Command code.
+ * \param[in] pre     First part of the command payload.
+ * \param[in] preLen  Length of the first part of the payload.
+ * \param[in] data    Second part of the command payload.
+ * \param[in] len     Length of the second part of the payload.
+ * \param[in] chk     Checksum field (only used by data commands).
+ *
+ * \return ESP_BL_OK if command was sent, ESP_BL_ERR_TX otherwise.
+ ****************************************************************************/
+static uint8_t EspBlFrameSend(uint8_t cmd, const uint8_t *pre,
+		uint16_t preLen, const uint8_t *data, uint16_t len, uint32_t chk) {
+	uint8_t hdr[ESP_BL_HDR_LEN];
+
+	// Header: direction (0 for requests), command, length and checksum
+	hdr[0] = 0x00;
+	hdr[1] = cmd;
+	hdr[2] = (preLen + len);
+	hdr[3] = (preLen + len)>>8;
+	EspBlDwordPut(hdr + 4, chk);
+
+	// Send header and payload in a single frame
+	if (SlipSplitFrameSendSof(ESP_BL_TOUT_MS) ||
+			(SlipSplitFrameAppendPoll(hdr, ESP_BL_HDR_LEN,
+				ESP_BL_TOUT_MS) != ESP_BL_HDR_LEN) ||
+			(preLen && (SlipSplitFrameAppendPoll((uint8_t*)pre, preLen,
+				ESP_BL_TOUT_MS) != preLen)) ||
+			(len && (SlipSplitFrameAppendPoll((uint8_t*)data, len,
+				ESP_BL_TOUT_MS) != len)) ||
+			SlipSplitFrameSendEof(ESP_BL_TOUT_MS)) {
+		return ESP_BL_ERR_TX;
+	}
+
+	return ESP_BL_OK;
+}
+
+/************************************************************************//**
+ * \brief Waits for the reply to a command. Frames received not matching
+ *        the command are discarded.
+ *
+ * \param[in]  cmd   Command code.
+ * \param[out] value Value field of the reply. Can be NULL.
+ * \param[in]  touts Number of reply timeouts allowed (ESP_BL_TOUT_MS
+ *                   each).
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+static uint8_t EspBlReplyWait(uint8_t cmd, uint32_t *value, uint16_t touts) {
+	uint16_t frameLen;
+	uint8_t tries;
+
+	// Wait for the reply, discarding frames not matching the command
+	for (tries = ESP_BL_REPLY_TRIES; tries; tries--) {
+		switch (SlipFrameRecvPoll(rep, ESP_BL_REPLY_MAX, &frameLen,
+					ESP_BL_TOUT_MS)) {
+			case 0:
+				break;
+
+			case 1:
+				if (touts > 1) {
+					touts--;
+					tries++;
+					// Avoid USB timing out
+					USB_USBTask();
+					continue;
+				}
+				return ESP_BL_TIMEOUT;
+
+			default:
+				// Frame too long or malformed, try next one
+				continue;
+		}
+		if ((frameLen < ESP_BL_HDR_LEN) || (1 != rep[0]) || (cmd != rep[1]))
+			continue;
+		repDataLen = rep[2] | (rep[3]<<8);
+		if ((repDataLen < 2) || ((ESP_BL_HDR_LEN + repDataLen) > frameLen))
+			return ESP_BL_ERR_STAT;
+		if (value) {
+			*value = ((uint32_t)rep[7]<<24) | ((uint32_t)rep[6]<<16) |
+				((uint32_t)rep[5]<<8) | rep[4];
+		}
+		// Status and error bytes are the last two of the payload
+		return rep[ESP_BL_HDR_LEN + repDataLen - 2]?ESP_BL_ERR_STAT:
+			ESP_BL_OK;
+	}
+
+	return ESP_BL_TIMEOUT;
+}
+
+/************************************************************************//**
+ * \brief Sends a command to the bootloader and waits for its reply. Frames
+ *        received not matching the command are discarded.
+ *
+ * \param[in]  cmd   Command code.
+ * \param[in]  data  Command payload.
+ * \param[in]  len   Length of the command payload.
+ * \param[in]  chk   Checksum field (only used by data commands).
+ * \param[out] value Value field of the reply. Can be NULL.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlCmd(uint8_t cmd, const uint8_t *data, uint16_t len,
+		uint32_t chk, uint32_t *value) {
+	return EspBlCmdLong(cmd, data, len, chk, value, 1);
+}
+
+/************************************************************************//**
+ * \brief Sends a command to the bootloader and waits for its reply, allowing
+ *        several reply timeouts. Useful for commands taking long to
+ *        complete.
+ *
+ * \param[in]  cmd   Command code.
+ * \param[in]  data  Command payload.
+ * \param[in]  len   Length of the command payload.
+ * \param[in]  chk   Checksum field (only used by data commands).
+ * \param[out] value Value field of the reply. Can be NULL.
+ * \param[in]  touts Number of reply timeouts allowed (ESP_BL_TOUT_MS
+ *                   each).
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlCmdLong(uint8_t cmd, const uint8_t *data, uint16_t len,
+		uint32_t chk, uint32_t *value, uint16_t touts) {
+	if (EspBlFrameSend(cmd, NULL, 0, data, len, chk)) return ESP_BL_ERR_TX;
+
+	return EspBlReplyWait(cmd, value, touts);
+}
+
+/************************************************************************//**
+ * \brief Obtains the payload of the last reply received by EspBlCmd().
+ *
+ * \param[out] len Length of the reply payload (including status bytes).
+ *
+ * \return Pointer to the reply payload.
+ ****************************************************************************/
+const uint8_t *EspBlReplyData(uint16_t *len) {
+	*len = repDataLen;
+	return rep + ESP_BL_HDR_LEN;
+}
+
+/************************************************************************//**
+ * \brief Waits for the specified time on the millisecond clock, servicing
+ *        USB meanwhile.
+ *
+ * \param[in] ms Milliseconds to wait.
+ ****************************************************************************/
+static void EspBlWait(uint16_t ms) {
+	uint16_t start;
+
+	for (start = TimerMsGet(); TimerMsElapsed(start) < ms;) USB_USBTask();
+}
+
+/************************************************************************//**
+ * \brief Tries synchronizing with the bootloader.
+ *
+ * \param[in] tries Maximum number of SYNC attempts.
+ *
+ * \return ESP_BL_OK if synchronized, ESP_BL_TIMEOUT otherwise.
+ ****************************************************************************/
+uint8_t EspBlSync(uint8_t tries) {
+	for (; tries; tries--) {
+		SlipFlush();
+		if (ESP_BL_OK == EspBlCmd(ESP_BL_CMD_SYNC, syncData,
+					sizeof(syncData), 0, NULL)) {
+			return ESP_BL_OK;
+		}
+		// Avoid USB timing out
+		USB_USBTask();
+	}
+
+	return ESP_BL_TIMEOUT;
+}
+
+/************************************************************************//**
+ * \brief Checks the link. SYNC is used with the ROM bootloader (allowing it
+ *        to detect the baud rate), and a register read with the stub.
+ *
+ * \return ESP_BL_OK if link is working, ESP_BL_TIMEOUT otherwise.
+ ****************************************************************************/
+static uint8_t EspBlLinkCheck(void) {
+	uint8_t param[4];
+	uint8_t tries;
+
+	if (!stubOn) return EspBlSync(ESP_BL_BAUD_SYNC_TRIES);
+
+	EspBlDwordPut(param, ESP_BL_LINK_CHECK_REG);
+	for (tries = ESP_BL_BAUD_SYNC_TRIES; tries; tries--) {
+		SlipFlush();
+		if (ESP_BL_OK == EspBlCmd(ESP_BL_CMD_READ_REG, param, sizeof(param),
+					0, NULL)) {
+			return ESP_BL_OK;
+		}
+		USB_USBTask();
+	}
+
+	return ESP_BL_TIMEOUT;
+}
+
+/************************************************************************//**
+ * \brief Changes the UART baud rate. The bootloader is requested to change
+ *        its baud rate, then the local UART is reprogrammed and the link is
+ *        checked. If link check fails, previous baud rate is restored.
+ *
+ * \param[in] baud New baud rate.
+ *
+ * \return ESP_BL_OK if baud rate was changed, ESP_BL_ERR_PARAM if baud rate
+ *         is not supported by the UART, ESP_BL_FALLBACK if the link check
+ *         failed and previous baud rate was restored, or ESP_BL_ERR_LINK
+ *         if link could not be restored.
+ ****************************************************************************/
+uint8_t EspBlBaudChange(uint32_t baud) {
+	uint32_t prev = UartBaudGet();
+	uint8_t param[8];
+
+	if (!UartBaudDivisor(baud)) return ESP_BL_ERR_PARAM;
+	if (baud == prev) return ESP_BL_OK;
+
+	// Request baud rate change. Second parameter (current baud rate) must
+	// be 0 when talking to the ROM bootloader. ESP8266 ROM bootloader
+	// rejects this command, but it auto-bauds when receiving SYNC
+	// commands, so the result is ignored. The stub replies and then
+	// switches to the new baud rate.
+	EspBlDwordPut(param, baud);
+	EspBlDwordPut(param + 4, stubOn?prev:0);
+	EspBlCmd(ESP_BL_CMD_CHANGE_BAUDRATE, param, sizeof(param), 0, NULL);
+	EspBlWait(ESP_BL_BAUD_SETTLE_MS);
+
+	// Switch baud rate and check link
+	UartBaudSet(baud);
+	if (ESP_BL_OK == EspBlLinkCheck()) return ESP_BL_OK;
+
+	// Link check failed, restore previous baud rate
+	UartBaudSet(prev);
+	if (ESP_BL_OK == EspBlLinkCheck()) return ESP_BL_FALLBACK;
+
+	return ESP_BL_ERR_LINK;
+}
+
+/************************************************************************//**
+ * \brief Boots the module into the ROM bootloader and synchronizes with it.
+ *        The module is reset with the program line asserted, and the SYNC
+ *        sequence is started once the bootloader is ready. If
+ *        synchronization fails, the complete sequence is repeated up to
+ *        ESP_BL_BOOT_TRIES times. Optionally, the baud rate is then changed.
+ *
+ * \param[in] tries SYNC attempts after each reset.
+ * \param[in] baud  Baud rate to use after synchronizing, 0 to keep UART_BR.
+ *
+ * \return ESP_BL_OK on success, ESP_BL_TIMEOUT if synchronization failed,
+ *         or the error code returned by EspBlBaudChange().
+ ****************************************************************************/
+uint8_t EspBlBoot(uint8_t tries, uint32_t baud) {
+	uint8_t boots;
+
+	if (baud && !UartBaudDivisor(baud)) return ESP_BL_ERR_PARAM;
+
+	for (boots = ESP_BL_BOOT_TRIES; boots; boots--) {
+		// Reset with GPIO0 low to boot from UART
+		WiFiReset();
+		WiFiPrgEnable();
+		EspBlInit();
+		UartBaudSet(UART_BR);
+		EspBlWait(ESP_BL_BOOT_RST_MS);
+		WiFiStart();
+		EspBlWait(ESP_BL_BOOT_READY_MS);
+		// Release GPIO0 so next reset boots the application, and
+		// discard the boot message
+		WiFiPrgDisable();
+		UartFlush();
+		SlipFlush();
+		if (ESP_BL_OK == EspBlSync(tries)) break;
+	}
+	if (!boots) return ESP_BL_TIMEOUT;
+
+	return baud?EspBlBaudChange(baud):ESP_BL_OK;
+}
+
+/************************************************************************//**
+ * \brief Sends a data block command (FLASH_DATA, FLASH_DEFL_DATA), retrying
+ *        up to ESP_BL_DATA_TRIES times.
+ *
+ * \param[in] cmd   Command code.
+ * \param[in] blk   Data block.
+ * \param[in] len   Length of the data block.
+ * \param[in] seq   Block sequence number, starting with 0.
+ * \param[in] touts Number of reply timeouts allowed on each try.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+static uint8_t EspBlDataSend(uint8_t cmd, const uint8_t blk[], uint16_t len,
+		uint32_t seq, uint16_t touts) {
+	uint8_t param[16];
+	uint8_t chk = ESP_BL_CHK_SEED;
+	uint8_t stat = ESP_BL_ERR_PARAM;
+	uint8_t tries;
+	uint16_t i;
+
+	for (i = 0; i < len; i++) chk ^= blk[i];
+
+	// Data length, sequence number, and two zero words
+	EspBlDwordPut(param, len);
+	EspBlDwordPut(param + 4, seq);
+	EspBlDwordPut(param + 8, 0);
+	EspBlDwordPut(param + 12, 0);
+
+	for (tries = ESP_BL_DATA_TRIES; tries; tries--) {
+		stat = EspBlFrameSend(cmd, param, sizeof(param), blk, len, chk);
+		if (ESP_BL_OK == stat) stat = EspBlReplyWait(cmd, NULL, touts);
+		if (ESP_BL_OK == stat) break;
+		// Discard any partially received reply before retrying
+		SlipFlush();
+	}
+
+	return stat;
+}
+
+/************************************************************************//**
+ * \brief Computes the erase size to request in FLASH_BEGIN. The ESP8266 ROM
+ *        bootloader erases more than requested when the region is not
+ *        aligned to an erase block, so requested size is adjusted to
+ *        compensate.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Image length.
+ *
+ * \return Erase size to send in FLASH_BEGIN.
+ ****************************************************************************/
+uint32_t EspBlEraseSizeGet(uint32_t addr, uint32_t len) {
+	uint16_t sects = (len + ESP_BL_FLASH_SECT_LEN - 1) / ESP_BL_FLASH_SECT_LEN;
+	uint16_t head = ESP_BL_FLASH_SECT_PER_BLOCK -
+		((addr / ESP_BL_FLASH_SECT_LEN) % ESP_BL_FLASH_SECT_PER_BLOCK);
+
+	if (sects < head) head = sects;
+	if (sects < 2 * head) {
+		return (uint32_t)((sects + 1) / 2) * ESP_BL_FLASH_SECT_LEN;
+	}
+	return (uint32_t)(sects - head) * ESP_BL_FLASH_SECT_LEN;
+}
+
+/************************************************************************//**
+ * \brief Starts a flash download. The bootloader erases the flash region
+ *        before replying.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Image length.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashBegin(uint32_t addr, uint32_t len) {
+	uint8_t param[16];
+	uint16_t sects = (len + ESP_BL_FLASH_SECT_LEN - 1) / ESP_BL_FLASH_SECT_LEN;
+
+	// Erase size, number of blocks, block size and offset. The stub erases
+	// exactly the requested size, and does it while data is written.
+	EspBlDwordPut(param, stubOn?len:EspBlEraseSizeGet(addr, len));
+	EspBlDwordPut(param + 4, (len + ESP_BL_FLASH_BLOCK_LEN - 1) /
+			ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 8, ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 12, addr);
+
+	return EspBlCmdLong(ESP_BL_CMD_FLASH_BEGIN, param, sizeof(param), 0,
+			NULL, 1 + sects * ESP_BL_ERASE_TOUTS_PER_SECT);
+}
+
+/************************************************************************//**
+ * \brief Writes a data block to flash, retrying up to ESP_BL_DATA_TRIES
+ *        times. Short blocks are padded with 0xFF.
+ *
+ * \param[inout] blk Data block. Buffer must be ESP_BL_FLASH_BLOCK_LEN bytes
+ *                    long, since it is used for padding.
+ * \param[in]    len Length of the data in the block.
+ * \param[in]    seq Block sequence number, starting with 0.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashData(uint8_t blk[], uint16_t len, uint32_t seq) {
+	if (len > ESP_BL_FLASH_BLOCK_LEN) return ESP_BL_ERR_PARAM;
+	// Pad block
+	memset(blk + len, 0xFF, ESP_BL_FLASH_BLOCK_LEN - len);
+
+	return EspBlDataSend(ESP_BL_CMD_FLASH_DATA, blk, ESP_BL_FLASH_BLOCK_LEN,
+			seq, 1);
+}
+
+/************************************************************************//**
+ * \brief Finishes a flash download.
+ *
+ * \param[in] reboot If TRUE, the module reboots and runs the application.
+ *                   Otherwise it stays in bootloader mode.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashEnd(uint8_t reboot) {
+	uint8_t param[4];
+
+	// Parameter is 0 to reboot, 1 to stay in the bootloader
+	EspBlDwordPut(param, reboot?0:1);
+
+	return EspBlCmd(ESP_BL_CMD_FLASH_END, param, sizeof(param), 0, NULL);
+}
+
+/************************************************************************//**
+ * \brief Starts a compressed flash download. Flash is erased by the stub
+ *        while data is written, so this command replies immediately.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Uncompressed image length.
+ * \param[in] zlen Compressed image length.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ * \note Compressed downloads are not supported by the ESP8266 ROM
+ *       bootloader, the flasher stub must be running.
+ ****************************************************************************/
+uint8_t EspBlDeflBegin(uint32_t addr, uint32_t len, uint32_t zlen) {
+	uint8_t param[16];
+
+	// Uncompressed size, number of blocks, block size and offset
+	EspBlDwordPut(param, len);
+	EspBlDwordPut(param + 4, (zlen + ESP_BL_FLASH_BLOCK_LEN - 1) /
+			ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 8, ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 12, addr);
+
+	return EspBlCmd(ESP_BL_CMD_DEFL_BEGIN, param, sizeof(param), 0, NULL);
+}
+
+/************************************************************************//**
+ * \brief Writes a compressed data block to flash, retrying up to
+ *        ESP_BL_DATA_TRIES times. Blocks are not padded.
+ *
+ * \param[in] blk Compressed data block.
+ * \param[in] len Length of the data in the block.
+ * \param[in] seq Block sequence number, starting with 0.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlDeflData(const uint8_t blk[], uint16_t len, uint32_t seq) {
+	if (len > ESP_BL_FLASH_BLOCK_LEN) return ESP_BL_ERR_PARAM;
+
+	return EspBlDataSend(ESP_BL_CMD_DEFL_DATA, blk, len, seq,
+			ESP_BL_DEFL_DATA_TOUTS);
+}
+
+/************************************************************************//**
+ * \brief Finishes a compressed flash download.
+ *
+ * \param[in] reboot If TRUE, the module reboots and runs the application.
+ *                   Otherwise it stays in bootloader mode.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlDeflEnd(uint8_t reboot) {
+	uint8_t param[4];
+
+	// Parameter is 0 to reboot, 1 to stay in the bootloader
+	EspBlDwordPut(param, reboot?0:1);
+
+	return EspBlCmd(ESP_BL_CMD_DEFL_END, param, sizeof(param), 0, NULL);
+}
+
+#ifdef ESP_STUB_HDR
+/************************************************************************//**
+ * \brief Loads a segment stored in program memory to the module RAM.
+ *
+ * \param[in] seg  Segment data, in program memory.
+ * \param[in] len  Segment length.
+ * \param[in] addr Load address.
+ * \param[in] blk  Buffer used for uploading, ESP_BL_FLASH_BLOCK_LEN bytes
+ *                 long.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+static uint8_t EspBlMemLoad(const uint8_t *seg, uint16_t len, uint32_t addr,
+		uint8_t blk[]) {
+	uint8_t param[16];
+	uint16_t pos;
+	uint16_t step;
+	uint32_t seq;
+	uint8_t stat;
+
+	// Size, number of blocks, block size and offset
+	EspBlDwordPut(param, len);
+	EspBlDwordPut(param + 4, (len + ESP_BL_FLASH_BLOCK_LEN - 1) /
+			ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 8, ESP_BL_FLASH_BLOCK_LEN);
+	EspBlDwordPut(param + 12, addr);
+	if ((stat = EspBlCmd(ESP_BL_CMD_MEM_BEGIN, param, sizeof(param), 0,
+					NULL))) return stat;
+
+	for (pos = 0, seq = 0; pos < len; pos += step, seq++) {
+		step = MIN(ESP_BL_FLASH_BLOCK_LEN, len - pos);
+		memcpy_P(blk, seg + pos, step);
+		if ((stat = EspBlDataSend(ESP_BL_CMD_MEM_DATA, blk, step, seq, 1)))
+			return stat;
+	}
+
+	return ESP_BL_OK;
+}
+#endif
+
+/************************************************************************//**
+ * \brief Uploads the flasher stub to the module RAM and runs it. From then
+ *        on, commands are processed by the stub.
+ *
+ * \param[in] blk Buffer used for uploading, ESP_BL_FLASH_BLOCK_LEN bytes
+ *                long.
+ *
+ * \return ESP_BL_OK if stub is running, ESP_BL_ERR_NO_STUB if firmware was
+ *         built without stub, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlStubRun(uint8_t blk[]) {
+#ifdef ESP_STUB_HDR
+	uint8_t param[8];
+	uint16_t frameLen;
+	uint8_t tries;
+	uint8_t stat;
+
+	if (stubOn) return ESP_BL_OK;
+	if ((stat = EspBlMemLoad(espStubText, sizeof(espStubText),
+					ESP_STUB_TEXT_ADDR, blk)) ||
+			(stat = EspBlMemLoad(espStubData, sizeof(espStubData),
+					ESP_STUB_DATA_ADDR, blk))) {
+		return stat;
+	}
+
+	// Run stub: first parameter is 0 to jump to the entry point
+	EspBlDwordPut(param, 0);
+	EspBlDwordPut(param + 4, ESP_STUB_ENTRY);
+	if ((stat = EspBlCmd(ESP_BL_CMD_MEM_END, param, sizeof(param), 0,
+					NULL))) return stat;
+
+	// Stub greets with an "OHAI" frame when ready
+	for (tries = ESP_BL_REPLY_TRIES; tries; tries--) {
+		if (!SlipFrameRecvPoll(rep, ESP_BL_REPLY_MAX, &frameLen,
+					ESP_BL_TOUT_MS) && (4 == frameLen) &&
+				!memcmp(rep, "OHAI", 4)) {
+			stubOn = TRUE;
+			return ESP_BL_OK;
+		}
+		USB_USBTask();
+	}
+
+	return ESP_BL_TIMEOUT;
+#else
+	return ESP_BL_ERR_NO_STUB;
+#endif
+}
+
+/************************************************************************//**
+ * \brief Checks if the flasher stub is running.
+ *
+ * \return TRUE if the stub is running, FALSE if talking to the ROM.
+ ****************************************************************************/
+uint8_t EspBlStubRunning(void) {
+	return stubOn;
+}
+
+/************************************************************************//**
+ * \brief Erases a flash region, or the complete chip if len is 0. Requires
+ *        the stub to be running.
+ *
+ * \param[in] addr Start address, must be sector aligned.
+ * \param[in] len  Length of the region, must be a multiple of the sector
+ *                 length. If 0, the complete chip is erased.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlErase(uint32_t addr, uint32_t len) {
+	uint8_t param[8];
+
+	if (!stubOn) return ESP_BL_ERR_NO_STUB;
+	if (!len) {
+		return EspBlCmdLong(ESP_BL_CMD_ERASE_FLASH, NULL, 0, 0, NULL,
+				ESP_BL_CHIP_ERASE_TOUTS);
+	}
+	if ((addr | len) & (ESP_BL_FLASH_SECT_LEN - 1)) return ESP_BL_ERR_PARAM;
+
+	EspBlDwordPut(param, addr);
+	EspBlDwordPut(param + 4, len);
+	return EspBlCmdLong(ESP_BL_CMD_ERASE_REGION, param, sizeof(param), 0,
+			NULL, 1 + (len / ESP_BL_FLASH_SECT_LEN) *
+			ESP_BL_ERASE_TOUTS_PER_SECT);
+}
+
+/************************************************************************//**
+ * \brief Computes the MD5 digest of a flash region. Requires the stub to be
+ *        running.
+ *
+ * \param[in]  addr Start address of the region.
+ * \param[in]  len  Length of the region.
+ * \param[out] md5  Computed digest (ESP_BL_MD5_LEN bytes).
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlMd5(uint32_t addr, uint32_t len, uint8_t md5[]) {
+	uint8_t param[16];
+	const uint8_t *res;
+	uint16_t resLen;
+	uint8_t stat;
+
+	if (!stubOn) return ESP_BL_ERR_NO_STUB;
+
+	// Address, size and two zero words
+	EspBlDwordPut(param, addr);
+	EspBlDwordPut(param + 4, len);
+	EspBlDwordPut(param + 8, 0);
+	EspBlDwordPut(param + 12, 0);
+	if ((stat = EspBlCmdLong(ESP_BL_CMD_SPI_FLASH_MD5, param, sizeof(param),
+					0, NULL, 1 + (len / ESP_BL_FLASH_SECT_LEN) *
+					ESP_BL_MD5_TOUTS_PER_SECT))) {
+		return stat;
+	}
+
+	// Stub sends the raw digest
+	res = EspBlReplyData(&resLen);
+	if ((ESP_BL_MD5_LEN + 2) != resLen) return ESP_BL_ERR_STAT;
+	memcpy(md5, res, ESP_BL_MD5_LEN);
+
+	return ESP_BL_OK;
+}
+
+/************************************************************************//**
+ * \brief Starts reading a flash region. Data is then obtained by calling
+ *        EspBlReadData() until the complete region is read, and finally
+ *        EspBlReadEnd() must be called. Requires the stub to be running.
+ *
+ * \param[in] addr   Start address of the region.
+ * \param[in] len    Length of the region.
+ * \param[in] blkLen Length of the data blocks sent by the stub.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadBegin(uint32_t addr, uint32_t len, uint16_t blkLen) {
+	uint8_t param[16];
+
+	if (!stubOn) return ESP_BL_ERR_NO_STUB;
+	// Address, length, block length and maximum blocks in flight
+	EspBlDwordPut(param, addr);
+	EspBlDwordPut(param + 4, len);
+	EspBlDwordPut(param + 8, blkLen);
+	EspBlDwordPut(param + 12, ESP_BL_READ_INFLIGHT);
+
+	return EspBlCmd(ESP_BL_CMD_READ_FLASH, param, sizeof(param), 0, NULL);
+}
+
+/************************************************************************//**
+ * \brief Receives a data block of a flash read, and acknowledges it.
+ *
+ * \param[out]   blk   Buffer for the received block, must be at least the
+ *                     blkLen passed to EspBlReadBegin().
+ * \param[in]    max   Length of blk buffer.
+ * \param[out]   len   Length of the received block.
+ * \param[inout] total Bytes received since EspBlReadBegin(). Must be 0
+ *                     before receiving the first block.
+ *
+ * \return ESP_BL_OK if block was received, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadData(uint8_t blk[], uint16_t max, uint16_t *len,
+		uint32_t *total) {
+	uint8_t ack[4];
+
+	if (SlipFrameRecvPoll(blk, max, len, ESP_BL_TOUT_MS))
+		return ESP_BL_TIMEOUT;
+
+	// Acknowledge with the number of bytes received so far
+	*total += *len;
+	EspBlDwordPut(ack, *total);
+	if (SlipFrameSendPoll(ack, sizeof(ack), ESP_BL_TOUT_MS) !=
+			sizeof(ack)) return ESP_BL_ERR_TX;
+
+	return ESP_BL_OK;
+}
+
+/************************************************************************//**
+ * \brief Finishes a flash read, obtaining the MD5 digest of the read data.
+ *
+ * \param[out] md5 Digest computed by the stub (ESP_BL_MD5_LEN bytes).
+ *
+ * \return ESP_BL_OK if digest was received, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadEnd(uint8_t md5[]) {
+	uint16_t len;
+
+	if (SlipFrameRecvPoll(rep, ESP_BL_REPLY_MAX, &len, ESP_BL_TOUT_MS))
+		return ESP_BL_TIMEOUT;
+	if (ESP_BL_MD5_LEN != len) return ESP_BL_ERR_STAT;
+	memcpy(md5, rep, ESP_BL_MD5_LEN);
+
+	return ESP_BL_OK;
+}
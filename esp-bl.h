@@ -0,0 +1,371 @@
+/************************************************************************//**
+ * \file
+ * \brief ESP8266 ROM bootloader protocol handling. Commands are sent and
+ * replies received through the SLIP framing layer.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ * \defgroup esp-bl ESP8266 bootloader protocol.
+ * \{
+ ****************************************************************************/
+
+#ifndef _ESP_BL_H_
+#define _ESP_BL_H_
+
+#include <stdint.h>
+
+/** \addtogroup esp-bl EspBlCmds ESP8266 bootloader commands.
+ *  \{ */
+#define ESP_BL_CMD_FLASH_BEGIN		0x02	///< Start flash download
+#define ESP_BL_CMD_FLASH_DATA		0x03	///< Flash data block
+#define ESP_BL_CMD_FLASH_END		0x04	///< Finish flash download
+#define ESP_BL_CMD_MEM_BEGIN		0x05	///< Start RAM download
+#define ESP_BL_CMD_MEM_END			0x06	///< Finish RAM download and run
+#define ESP_BL_CMD_MEM_DATA			0x07	///< RAM data block
+#define ESP_BL_CMD_SYNC				0x08	///< Synchronize link
+#define ESP_BL_CMD_READ_REG			0x0A	///< Read register
+#define ESP_BL_CMD_CHANGE_BAUDRATE	0x0F	///< Change UART baud rate
+#define ESP_BL_CMD_DEFL_BEGIN		0x10	///< Start compressed download
+#define ESP_BL_CMD_DEFL_DATA		0x11	///< Compressed data block
+#define ESP_BL_CMD_DEFL_END			0x12	///< Finish compressed download
+#define ESP_BL_CMD_SPI_FLASH_MD5	0x13	///< Compute flash region MD5
+#define ESP_BL_CMD_ERASE_FLASH		0xD0	///< Erase chip (stub only)
+#define ESP_BL_CMD_ERASE_REGION		0xD1	///< Erase region (stub only)
+#define ESP_BL_CMD_READ_FLASH		0xD2	///< Read flash (stub only)
+/** \} */
+
+/*
+ * The flasher stub is not part of this source tree. To enable stub support,
+ * build with ESP_STUB=<header>. The header must define the stub image as
+ * obtained from esptool stub data:
+ * - ESP_STUB_TEXT_ADDR: Load address of the text segment.
+ * - ESP_STUB_DATA_ADDR: Load address of the data segment.
+ * - ESP_STUB_ENTRY:     Stub entry point.
+ * - espStubText[] and espStubData[]: PROGMEM arrays with the segments.
+ */
+
+/// Reset and SYNC sequences tried by EspBlBoot() before giving up
+#define ESP_BL_BOOT_TRIES		3
+
+/// Register read to check the link with the stub (chip detect magic)
+#define ESP_BL_LINK_CHECK_REG	0x40001000
+
+/// Reply timeouts allowed for a complete chip erase
+#define ESP_BL_CHIP_ERASE_TOUTS	2400
+
+/// Length of a MD5 digest
+#define ESP_BL_MD5_LEN			16
+
+/// Reply timeouts allowed for MD5 computation, for each flash sector
+#define ESP_BL_MD5_TOUTS_PER_SECT	1
+
+/// Number of read data frames the stub sends before waiting for an ack
+#define ESP_BL_READ_INFLIGHT	2
+
+/// Length of the data blocks written to the SPI flash
+#define ESP_BL_FLASH_BLOCK_LEN	0x400
+/// Length of a SPI flash sector
+#define ESP_BL_FLASH_SECT_LEN	0x1000
+/// Number of sectors on each SPI flash erase block
+#define ESP_BL_FLASH_SECT_PER_BLOCK	16
+
+/// Initial value of the data checksum
+#define ESP_BL_CHK_SEED			0xEF
+
+/// Number of times a data block is sent before giving up
+#define ESP_BL_DATA_TRIES		3
+
+/// Reply timeouts allowed for FLASH_BEGIN, for each erased sector (the
+/// ROM bootloader erases the flash before replying).
+#define ESP_BL_ERASE_TOUTS_PER_SECT	4
+
+/// Reply timeouts allowed for compressed data blocks. The stub decompresses
+/// and erases the flash as needed before replying.
+#define ESP_BL_DEFL_DATA_TOUTS	20
+
+/// Length of the command/reply header
+#define ESP_BL_HDR_LEN			8
+
+/// Maximum length of a command reply (including header)
+#define ESP_BL_REPLY_MAX		48
+
+/// Timeout while waiting for a reply, in milliseconds
+#define ESP_BL_TOUT_MS			250
+
+/// Number of received frames not matching the command, before giving up
+/// waiting for a reply.
+#define ESP_BL_REPLY_TRIES		8
+
+/// Number of SYNC attempts performed after changing baud rate
+#define ESP_BL_BAUD_SYNC_TRIES	10
+
+/** \addtogroup esp-bl EspBlStat Status codes returned by module functions.
+ *  \{ */
+typedef enum {
+	ESP_BL_OK = 0,		///< Success.
+	ESP_BL_TIMEOUT,		///< Timeout waiting for the reply.
+	ESP_BL_ERR_TX,		///< Could not send the command.
+	ESP_BL_ERR_STAT,	///< Module replied with an error status.
+	ESP_BL_ERR_PARAM,	///< Invalid parameter.
+	ESP_BL_FALLBACK,	///< Could not change baud rate, previous one restored.
+	ESP_BL_ERR_LINK,	///< Link lost.
+	ESP_BL_ERR_NO_STUB,	///< Stub not available or not running.
+	ESP_BL_ABORTED		///< Operation aborted by the caller.
+} EspBlStat;
+/** \} */
+
+/************************************************************************//**
+ * \brief Resets module state. Must be called each time the WiFi module or
+ *        the UART are reset.
+ ****************************************************************************/
+void EspBlInit(void);
+
+/************************************************************************//**
+ * \brief Sends a command to the bootloader and waits for its reply. Frames
+ *        received not matching the command are discarded.
+ *
+ * \param[in]  cmd   Command code.
+ * \param[in]  data  Command payload.
+ * \param[in]  len   Length of the command payload.
+ * \param[in]  chk   Checksum field (only used by data commands).
+ * \param[out] value Value field of the reply. Can be NULL.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ * \note Payload of the reply can be obtained with EspBlReplyData().
+ ****************************************************************************/
+uint8_t EspBlCmd(uint8_t cmd, const uint8_t *data, uint16_t len,
+		uint32_t chk, uint32_t *value);
+
+/************************************************************************//**
+ * \brief Sends a command to the bootloader and waits for its reply, allowing
+ *        several reply timeouts. Useful for commands taking long to
+ *        complete.
+ *
+ * \param[in]  cmd   Command code.
+ * \param[in]  data  Command payload.
+ * \param[in]  len   Length of the command payload.
+ * \param[in]  chk   Checksum field (only used by data commands).
+ * \param[out] value Value field of the reply. Can be NULL.
+ * \param[in]  touts Number of reply timeouts allowed (ESP_BL_TOUT_MS
+ *                   each).
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlCmdLong(uint8_t cmd, const uint8_t *data, uint16_t len,
+		uint32_t chk, uint32_t *value, uint16_t touts);
+
+/************************************************************************//**
+ * \brief Obtains the payload of the last reply received by EspBlCmd().
+ *
+ * \param[out] len Length of the reply payload (including status bytes).
+ *
+ * \return Pointer to the reply payload.
+ ****************************************************************************/
+const uint8_t *EspBlReplyData(uint16_t *len);
+
+/************************************************************************//**
+ * \brief Tries synchronizing with the bootloader.
+ *
+ * \param[in] tries Maximum number of SYNC attempts.
+ *
+ * \return ESP_BL_OK if synchronized, ESP_BL_TIMEOUT otherwise.
+ ****************************************************************************/
+uint8_t EspBlSync(uint8_t tries);
+
+/************************************************************************//**
+ * \brief Changes the UART baud rate. The bootloader is requested to change
+ *        its baud rate, then the local UART is reprogrammed and the link is
+ *        checked with SYNC commands. If link check fails, previous baud rate
+ *        is restored.
+ *
+ * \param[in] baud New baud rate.
+ *
+ * \return ESP_BL_OK if baud rate was changed, ESP_BL_ERR_PARAM if baud rate
+ *         is not supported by the UART, ESP_BL_FALLBACK if the link check
+ *         failed and previous baud rate was restored, or ESP_BL_ERR_LINK
+ *         if link could not be restored.
+ ****************************************************************************/
+uint8_t EspBlBaudChange(uint32_t baud);
+
+/************************************************************************//**
+ * \brief Boots the module into the ROM bootloader and synchronizes with it.
+ *        The module is reset with the program line asserted, and the SYNC
+ *        sequence is started once the bootloader is ready. If
+ *        synchronization fails, the complete sequence is repeated up to
+ *        ESP_BL_BOOT_TRIES times. Optionally, the baud rate is then changed.
+ *
+ * \param[in] tries SYNC attempts after each reset.
+ * \param[in] baud  Baud rate to use after synchronizing, 0 to keep UART_BR.
+ *
+ * \return ESP_BL_OK on success, ESP_BL_TIMEOUT if synchronization failed,
+ *         or the error code returned by EspBlBaudChange().
+ ****************************************************************************/
+uint8_t EspBlBoot(uint8_t tries, uint32_t baud);
+
+/************************************************************************//**
+ * \brief Computes the erase size to request in FLASH_BEGIN. The ESP8266 ROM
+ *        bootloader erases more than requested when the region is not
+ *        aligned to an erase block, so requested size is adjusted to
+ *        compensate.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Image length.
+ *
+ * \return Erase size to send in FLASH_BEGIN.
+ ****************************************************************************/
+uint32_t EspBlEraseSizeGet(uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * \brief Starts a flash download. The bootloader erases the flash region
+ *        before replying.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Image length.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashBegin(uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * \brief Writes a data block to flash, retrying up to ESP_BL_DATA_TRIES
+ *        times. Short blocks are padded with 0xFF.
+ *
+ * \param[inout] blk Data block. Buffer must be ESP_BL_FLASH_BLOCK_LEN bytes
+ *                    long, since it is used for padding.
+ * \param[in]    len Length of the data in the block.
+ * \param[in]    seq Block sequence number, starting with 0.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashData(uint8_t blk[], uint16_t len, uint32_t seq);
+
+/************************************************************************//**
+ * \brief Finishes a flash download.
+ *
+ * \param[in] reboot If TRUE, the module reboots and runs the application.
+ *                   Otherwise it stays in bootloader mode.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlFlashEnd(uint8_t reboot);
+
+/************************************************************************//**
+ * \brief Starts a compressed flash download. Flash is erased by the stub
+ *        while data is written, so this command replies immediately.
+ *
+ * \param[in] addr Flash address of the image.
+ * \param[in] len  Uncompressed image length.
+ * \param[in] zlen Compressed image length.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ * \note Compressed downloads are not supported by the ESP8266 ROM
+ *       bootloader, the flasher stub must be running.
+ ****************************************************************************/
+uint8_t EspBlDeflBegin(uint32_t addr, uint32_t len, uint32_t zlen);
+
+/************************************************************************//**
+ * \brief Writes a compressed data block to flash, retrying up to
+ *        ESP_BL_DATA_TRIES times. Blocks are not padded.
+ *
+ * \param[in] blk Compressed data block.
+ * \param[in] len Length of the data in the block.
+ * \param[in] seq Block sequence number, starting with 0.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlDeflData(const uint8_t blk[], uint16_t len, uint32_t seq);
+
+/************************************************************************//**
+ * \brief Finishes a compressed flash download.
+ *
+ * \param[in] reboot If TRUE, the module reboots and runs the application.
+ *                   Otherwise it stays in bootloader mode.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlDeflEnd(uint8_t reboot);
+
+/************************************************************************//**
+ * \brief Uploads the flasher stub to the module RAM and runs it. From then
+ *        on, commands are processed by the stub.
+ *
+ * \param[in] blk Buffer used for uploading, ESP_BL_FLASH_BLOCK_LEN bytes
+ *                long.
+ *
+ * \return ESP_BL_OK if stub is running, ESP_BL_ERR_NO_STUB if firmware was
+ *         built without stub, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlStubRun(uint8_t blk[]);
+
+/************************************************************************//**
+ * \brief Checks if the flasher stub is running.
+ *
+ * \return TRUE if the stub is running, FALSE if talking to the ROM.
+ ****************************************************************************/
+uint8_t EspBlStubRunning(void);
+
+/************************************************************************//**
+ * \brief Erases a flash region, or the complete chip if len is 0. Requires
+ *        the stub to be running.
+ *
+ * \param[in] addr Start address, must be sector aligned.
+ * \param[in] len  Length of the region, must be a multiple of the sector
+ *                 length. If 0, the complete chip is erased.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlErase(uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * \brief Computes the MD5 digest of a flash region. Requires the stub to be
+ *        running.
+ *
+ * \param[in]  addr Start address of the region.
+ * \param[in]  len  Length of the region.
+ * \param[out] md5  Computed digest (ESP_BL_MD5_LEN bytes).
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlMd5(uint32_t addr, uint32_t len, uint8_t md5[]);
+
+/************************************************************************//**
+ * \brief Starts reading a flash region. Data is then obtained by calling
+ *        EspBlReadData() until the complete region is read, and finally
+ *        EspBlReadEnd() must be called. Requires the stub to be running.
+ *
+ * \param[in] addr   Start address of the region.
+ * \param[in] len    Length of the region.
+ * \param[in] blkLen Length of the data blocks sent by the stub.
+ *
+ * \return ESP_BL_OK if command succeeded, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadBegin(uint32_t addr, uint32_t len, uint16_t blkLen);
+
+/************************************************************************//**
+ * \brief Receives a data block of a flash read, and acknowledges it.
+ *
+ * \param[out]   blk   Buffer for the received block, must be at least the
+ *                     blkLen passed to EspBlReadBegin().
+ * \param[in]    max   Length of blk buffer.
+ * \param[out]   len   Length of the received block.
+ * \param[inout] total Bytes received since EspBlReadBegin(). Must be 0
+ *                     before receiving the first block.
+ *
+ * \return ESP_BL_OK if block was received, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadData(uint8_t blk[], uint16_t max, uint16_t *len,
+		uint32_t *total);
+
+/************************************************************************//**
+ * \brief Finishes a flash read, obtaining the MD5 digest of the read data.
+ *
+ * \param[out] md5 Digest computed by the stub (ESP_BL_MD5_LEN bytes).
+ *
+ * \return ESP_BL_OK if digest was received, or the error code otherwise.
+ ****************************************************************************/
+uint8_t EspBlReadEnd(uint8_t md5[]);
+
+#endif /*_ESP_BL_H_*/
+
+/** \} */
+
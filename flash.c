@@ -8,6 +8,7 @@
  ****************************************************************************/
 
 #include "flash.h"
+#include "16c550.h"
 #include "util.h"
 #include <LUFA/Drivers/Board/LEDs.h>
 
@@ -51,8 +52,10 @@ const static uint16_t saddr[] = {
 uint8_t FlashDataPoll(uint32_t addr, uint16_t data) {
 	uint16_t read;
 
-	// Poll while DQ7 != data(7) and DQ5 == 0 and DQ1 == 0
+	// Poll while DQ7 != data(7) and DQ5 == 0 and DQ1 == 0. Bus is free
+	// between reads, so service the UART meanwhile.
 	do {
+		UartPumpYield();
 		read = FlashRead(addr);
 	} while (((data ^ read) & 0x80) && ((read & 0x22) == 0));
 
@@ -81,21 +84,35 @@ uint8_t FlashDataPoll(uint32_t addr, uint16_t data) {
  * \return 1 if OK, 0 if error during program operation.
  ****************************************************************************/
 uint8_t FlashErasePoll(uint32_t addr) {
-	uint16_t read;
+	uint8_t stat;
 
-	// Wait until DQ7 or DQ5 are set
+	// Wait until DQ7 or DQ5 are set, servicing the UART meanwhile
 	do {
-		read = FlashRead(addr);
-	} while (!(read & 0xA0));
+		UartPumpYield();
+	} while (FLASH_ERASE_BUSY == (stat = FlashEraseStat(addr)));
 
+	return stat;
+}
+
+/************************************************************************//**
+ * \brief Checks the status of an erase operation, without waiting.
+ *
+ * \param[in] addr Address contained in the erased zone.
+ * \return FLASH_ERASE_BUSY while erasing, FLASH_ERASE_OK if erase completed
+ *         successfully, or FLASH_ERASE_ERR if an error occurred.
+ ****************************************************************************/
+uint8_t FlashEraseStat(uint32_t addr) {
+	uint16_t read = FlashRead(addr);
+
+	// Busy until DQ7 or DQ5 are set
+	if (!(read & 0xA0)) return FLASH_ERASE_BUSY;
 
 	// If DQ5 is set, an error has occurred. Also a reset command needs to
 	// be sent to return to array read mode.
-	if (!(read & 0x80)) return 0;
+	if (!(read & 0x80)) return FLASH_ERASE_ERR;
 
 	FlashReset();
-	return 1;
-	//return (read & 0x80) != 0;
+	return FLASH_ERASE_OK;
 }
 
 /**
@@ -241,16 +258,24 @@ void FlashUnlockBypassReset(void) {
 }
 
 /************************************************************************//**
- * Erases the complete flash chip.
- *
- * \return '0' the if erase operation completed successfully, '1' otherwise.
+ * Starts a complete flash chip erase, without waiting for it to finish.
+ * Completion must be checked using FlashEraseStat().
  ****************************************************************************/
-uint8_t FlashChipErase(void) {
+void FlashChipEraseStart(void) {
 	uint8_t i;
 
 	// Unlock and write chip erase sequence
 	FlashUnlock();
 	FLASH_WRITE_CMD(FLASH_CHIP_ERASE, i);
+}
+
+/************************************************************************//**
+ * Erases the complete flash chip.
+ *
+ * \return '0' the if erase operation completed successfully, '1' otherwise.
+ ****************************************************************************/
+uint8_t FlashChipErase(void) {
+	FlashChipEraseStart();
 	// Poll until erase complete
 	return FlashErasePoll(0);
 }
@@ -275,7 +300,7 @@ uint8_t FlashSectErase(uint32_t addr) {
 	// Write sector address 
 	FlashWrite(sa, FLASH_SEC_ERASE_WR[0]);
 	// Wait until erase starts (polling DQ3)
-	while (!(FlashRead(sa) & 0x08));
+	while (!(FlashRead(sa) & 0x08)) UartPumpYield();
 	// Poll until erase complete
 	return FlashErasePoll(addr);
 }
@@ -319,6 +319,30 @@ static inline void FlashUnlockProgram(uint32_t addr, uint8_t data) {
  ****************************************************************************/
 void FlashUnlockBypassReset(void);
 
+/** \addtogroup flash FlashEraseStat Erase operation status.
+ *  \{ */
+enum {
+	FLASH_ERASE_ERR = 0,	///< Erase failed.
+	FLASH_ERASE_OK,			///< Erase completed.
+	FLASH_ERASE_BUSY		///< Erase in progress.
+};
+/** \} */
+
+/************************************************************************//**
+ * Starts a complete flash chip erase, without waiting for it to finish.
+ * Completion must be checked using FlashEraseStat().
+ ****************************************************************************/
+void FlashChipEraseStart(void);
+
+/************************************************************************//**
+ * \brief Checks the status of an erase operation, without waiting.
+ *
+ * \param[in] addr Address contained in the erased zone.
+ * \return FLASH_ERASE_BUSY while erasing, FLASH_ERASE_OK if erase completed
+ *         successfully, or FLASH_ERASE_ERR if an error occurred.
+ ****************************************************************************/
+uint8_t FlashEraseStat(uint32_t addr);
+
 /************************************************************************//**
  * Erases the complete flash chip.
  *
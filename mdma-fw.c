@@ -16,26 +16,42 @@
 #include "bloader.h"
 #include "timers.h"
 #include "wifi-if.h"
+#include "cdc-bridge.h"
 #include "slip.h"	// Delete after tests!
 
 // Define this to test BulkVendor echo
 //#define _DEBUG_ECHO_TEST
 
-/// \brief Returns cartridge status.
-CartStatus CheckCartStatus(void) {
-	// Status the last time this function was called.
-	static uint8_t lastStatus;
-	// Cartridge status
-	CartStatus s;
-
-	s.inserted = CIF__CIN_GET;
-	if (s.inserted != lastStatus) {
-		lastStatus = s.inserted;
-		s.statChange = TRUE;
-	} else {
-		s.statChange = FALSE;
-	}
-	return s;
+/// Pin change interrupt mask for the cart detect and button pins (PORTB)
+#define PIN_EVT_MASK	((1<<CIF__CIN) | BUTTONS_BUTTON1)
+
+/// PORTB pin status the last time the pin change interrupt ran
+static uint8_t pinLast;
+
+/************************************************************************//**
+ * \brief Enables the pin change interrupt for the cart detect and button
+ * pins, and posts events with their initial status.
+ ****************************************************************************/
+static void PinEvtInit(void) {
+	pinLast = PINB & PIN_EVT_MASK;
+	PCMSK0 |= PIN_EVT_MASK;
+	PCIFR = (1<<PCIF0);		// Clear pending interrupt flag
+	PCICR |= (1<<PCIE0);
+	SfEvtPost(CIF__CIN_GET?SF_EVT_CIN:SF_EVT_COUT);
+}
+
+/// Cart detect and button pin change. Posts the corresponding events, that
+/// are timestamped by SfEvtPost().
+ISR(PCINT0_vect) {
+	uint8_t pins = PINB & PIN_EVT_MASK;
+	uint8_t change = pins ^ pinLast;
+
+	pinLast = pins;
+	// Both signals are active low
+	if (change & (1<<CIF__CIN))
+		SfEvtPost((pins & (1<<CIF__CIN))?SF_EVT_COUT:SF_EVT_CIN);
+	if (change & BUTTONS_BUTTON1)
+		SfEvtPost((pins & BUTTONS_BUTTON1)?SF_EVT_SW_REL:SF_EVT_SW_PRESS);
 }
 
 
@@ -47,11 +63,6 @@ CartStatus CheckCartStatus(void) {
 #endif //_DEBUG_ECHO_TEST
 int main(void)
 {
-	uint8_t buttonStat, prevButtonStat;
-#ifndef _DEBUG_ECHO_TEST
-	CartStatus cs;
-#endif //_DEBUG_ECHO_TEST
-
 	// Init LUFA related stuff
 	SetupHardware();
 	// If button pressed, enter bootloader
@@ -62,6 +73,8 @@ int main(void)
 	CifInit();
 	// FIXME: REMOVE THIS LINE AFTER UART TEST
 	CIF_SET__RST;
+	// Start millisecond clock, used for timeouts
+	TimerMsStart();
 	// Init system state machine
 	SfInit();
 	// Initialize WiFi chip interface
@@ -73,9 +86,6 @@ int main(void)
 //	if (UartRead(UART_SPR) == 0x55) LEDs_TurnOnLEDs(LEDS_LED1);
 //	UartWrite(UART_SPR, 0xAA);
 //	if (UartRead(UART_SPR) == 0xAA) LEDs_TurnOnLEDs(LEDS_LED2);
-//	WiFiSendTest();
-//	WiFiEchoTest();
-//	WiFiEchoServerTest();
 //	const char testStr[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 //	while(1) {
 //		if (SlipFrameSendPoll((unsigned char*)testStr, sizeof(testStr),
@@ -83,37 +93,30 @@ int main(void)
 //			LEDs_TurnOnLEDs(LEDS_LED2);
 //	}
 	LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
-	prevButtonStat = Buttons_GetStatus();
-	GlobalInterruptEnable();
-
 #if !defined(_DEBUG_ECHO_TEST)
-	// Generate an initial cart event
-	cs = CheckCartStatus();
-	if (cs.inserted) SfFsmCycle(SF_EVT_CIN);
-	else SfFsmCycle(SF_EVT_COUT);
+	// Generate an initial cart event, following ones are generated on
+	// cart detect and button pin changes.
+	PinEvtInit();
 #endif //!defined(_DEBUG_ECHO_TEST)
+	GlobalInterruptEnable();
 
 	for (;;)
 	{
 		USB_USBTask();
-		// If button changed status, send event
-		if ((buttonStat = Buttons_GetStatus()) != prevButtonStat) {
-			SfFsmCycle(buttonStat?SF_EVT_SW_PRESS:SF_EVT_SW_REL);
-			prevButtonStat = buttonStat;
-		}
 
 #ifdef _DEBUG_ECHO_TEST	
 		memset(ReceivedData, 0x00, sizeof(ReceivedData));
 #else
-		// Check if there has been a change on cart status
-		cs = CheckCartStatus();
-		if (cs.statChange) SfFsmCycle(cs.inserted?
-				SF_EVT_CIN:SF_EVT_COUT);
-		// Check if we must generate a time event
-		if (SfEvtTimerNotify()) SfFsmCycle(SF_EVT_TIMER);
+		// Run expired software timers (posts SF_EVT_TIMER events)
+		TimerSwTask();
+		// Bridge WiFi UART and CDC interface
+		CdcBridgeTask();
+		// Keep captured module output before uartRxRing overflows
+		SfCaptureTask();
 #endif //_DEBUG_ECHO_TEST
+		// Host data is consumed by the running task, if any
 		Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
-		if (Endpoint_IsOUTReceived())
+		if (!SfTaskBusy() && Endpoint_IsOUTReceived())
 		{
 #ifdef _DEBUG_ECHO_TEST
 			Endpoint_Read_Stream_LE(ReceivedData, VENDOR_IO_EPSIZE, NULL);
@@ -123,11 +126,15 @@ int main(void)
 			Endpoint_Write_Stream_LE(ReceivedData, VENDOR_IO_EPSIZE, NULL);
 			Endpoint_ClearIN();
 #else
-			LEDs_TurnOnLEDs(LEDMASK_USB_BUSY);
-			SfFsmCycle(SF_EVT_DIN);
-			LEDs_TurnOffLEDs(LEDMASK_USB_BUSY);
+			SfEvtPost(SF_EVT_DIN);
 #endif // _DEBUG_ECHO_TEST
 		}
+#ifndef _DEBUG_ECHO_TEST
+		// Process pending events, highest priority first
+		SfEvtDispatch();
+		// Step long running command
+		SfTaskStep();
+#endif // _DEBUG_ECHO_TEST
 	}
 }
 
@@ -173,7 +180,7 @@ void EVENT_USB_Device_Disconnect(void)
 {
 	/* Indicate USB not ready */
 	LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
-	SfFsmCycle(SF_EVT_USB_DET);
+	SfEvtPost(SF_EVT_USB_DET);
 }
 
 /** \brief Event handler for the USB_ConfigurationChanged event. This is fired when the host set the current configuration
@@ -186,14 +193,16 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	/* Setup Vendor Data Endpoints */
 	configSuccess &= Endpoint_ConfigureEndpoint(VENDOR_IN_EPADDR,  EP_TYPE_BULK, VENDOR_I_EPSIZE, 2);
 	configSuccess &= Endpoint_ConfigureEndpoint(VENDOR_OUT_EPADDR, EP_TYPE_BULK, VENDOR_O_EPSIZE, 2);
+	/* Setup CDC Endpoints */
+	configSuccess &= CdcBridgeConfigure();
 
 	// Set LEDs and generate FSM events according to result
 	if (configSuccess) {
 		LEDs_SetAllLEDs(LEDMASK_USB_READY);
-		SfFsmCycle(SF_EVT_USB_ATT);
+		SfEvtPost(SF_EVT_USB_ATT);
 	} else {
 		LEDs_SetAllLEDs(LEDMASK_USB_ERROR);
-		SfFsmCycle(SF_EVT_USB_ERR);
+		SfEvtPost(SF_EVT_USB_ERR);
 	}
 }
 
@@ -203,5 +212,9 @@ void EVENT_USB_Device_ConfigurationChanged(void)
  */
 void EVENT_USB_Device_ControlRequest(void)
 {
-	// Process vendor specific control requests here
+	// Process vendor specific control requests
+	SfControlRequest();
+
+	// Process CDC class requests
+	CdcBridgeControlRequest();
 }
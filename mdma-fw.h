@@ -20,20 +20,6 @@
 		#include <LUFA/Platform/Platform.h>
 		#include <LUFA/Drivers/Board/Buttons.h>
 
-/** \addtogroup mdma-fw CartStatus Cartridge status information
- * Holds information about if the cartridge is or not inserted, and if
- * there has been a cartridge status change since last time.
- * \{
- */
-typedef union {
-	uint8_t all;				///< Access to all fields simultaneously
-	struct {
-		uint8_t statChange:1;	///< Status changed if TRUE
-		uint8_t inserted:1;		///< Cartridge inserted if TRUE
-	};
-} CartStatus;
-/** \} */
-
 	/* Macros: */
 		/** LED mask for the library LED driver, to indicate that the USB interface is not ready. */
 		#define LEDMASK_USB_NOTREADY      LEDS_NO_LEDS
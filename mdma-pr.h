@@ -28,9 +28,36 @@
 #define MDMA_WIFI_CMD_LONG 11	///< Long command forwarded to the WiFi chip.
 #define MDMA_WIFI_CTRL	   12	///< WiFi chip control action (using GPIO).
 #define MDMA_RANGE_ERASE   13	///< Erase a memory range of the flash chip
+#define MDMA_WIFI_FLASH	   14	///< Program the WiFi chip SPI flash.
+#define MDMA_WIFI_READ	   15	///< Read the WiFi chip SPI flash.
+#define MDMA_WIFI_CMD_STREAM 16	///< Long WiFi command with streamed reply.
+#define MDMA_WIFI_CMD_QUEUE  17	///< Queue WiFi command, reply not awaited.
+#define MDMA_WIFI_REPLY_GET  18	///< Get reply to a queued WiFi command.
+#define MDMA_WIFI_LOG_GET    19	///< Get captured WiFi module output.
+#define MDMA_LINK_STATS      20	///< Get UART, SLIP and USB error counters.
 #define MDMA_ERR		  255	///< Used to report ERROR during replies.
 /** \} */
 
+/** \addtogroup mdma-pr MdmaCtrlReqs Vendor control requests (bRequest
+ *  values, device recipient). Control requests are processed even while
+ *  a long command is running.
+ * \{
+ */
+/// Abort the running command (host to device, no data). Commands stop at
+/// the next safe point, and the flash chip is reset to read-array mode.
+/// Commands receiving data (MDMA_WRITE, MDMA_WIFI_FLASH) keep receiving
+/// and discarding it until the announced length is complete, so host
+/// must finish the transfer.
+#define MDMA_CTRL_ABORT		1
+/// Get the progress of the running (or last) command (device to host).
+/// Reply: command running (0 if none), TRUE if last command was aborted,
+/// and 4 bytes (little endian) with the words (flash) or bytes (WiFi)
+/// processed.
+#define MDMA_CTRL_PROGRESS	2
+/// Length of the MDMA_CTRL_PROGRESS reply
+#define MDMA_CTRL_PROGRESS_LEN	6
+/** \} */
+
 /// Obtains a double word (uint32_t) from the specified variable and offset.
 /// This macro is not optimal, but will always work, even if the address is
 /// misaligned. Order is little endian
@@ -0,0 +1,54 @@
+/************************************************************************//**
+ * \file
+ * \brief Minimal stackless coroutines (protothreads). A protothread is a
+ * function that returns each time it has to wait, and continues from the
+ * same point on next call. The resume point is kept in a Pt variable.
+ *
+ * Implemented using a switch statement, so protothread bodies must not
+ * contain switch statements, and local variables are not preserved across
+ * waits: state must be kept in static storage.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ * \defgroup pt Protothreads.
+ * \{
+ ****************************************************************************/
+
+#ifndef _PT_H_
+#define _PT_H_
+
+#include <stdint.h>
+
+/// Protothread resume point
+typedef uint16_t Pt;
+
+/** \addtogroup pt PtStat Values returned by protothreads.
+ *  \{ */
+enum {
+	PT_WAITING = 0,		///< Protothread is waiting, call it again.
+	PT_ENDED			///< Protothread has finished.
+};
+/** \} */
+
+/// Initializes a protothread, for it to start from the beginning.
+#define PT_INIT(pt)		do{*(pt) = 0;}while(0)
+
+/// Starts the protothread body.
+#define PT_BEGIN(pt)	switch (*(pt)) { case 0:
+
+/// Waits until cond is TRUE. Cond is evaluated each time the protothread
+/// is called.
+#define PT_WAIT_UNTIL(pt, cond)	do{*(pt) = __LINE__; case __LINE__:	\
+		if (!(cond)) return PT_WAITING;}while(0)
+
+/// Returns, continuing from this point on next call.
+#define PT_YIELD(pt)	do{*(pt) = __LINE__; return PT_WAITING;	\
+		case __LINE__:;}while(0)
+
+/// Ends the protothread body.
+#define PT_END(pt)		} *(pt) = 0; return PT_ENDED
+
+#endif /*_PT_H_*/
+
+/** \} */
+
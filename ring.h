@@ -0,0 +1,118 @@
+/************************************************************************//**
+ * \file
+ * \brief Byte ring buffers, suitable for passing data between an interrupt
+ * service routine and the main loop.
+ *
+ * Each ring must have a single producer and a single consumer. Since
+ * indexes are 8-bit wide, they are updated atomically, and no locking is
+ * needed as long as this rule is honored.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ * \defgroup ring Byte ring buffers.
+ * \{
+ ****************************************************************************/
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+/** \addtogroup ring Ring Ring buffer control data.
+ *  \{ */
+typedef struct {
+	uint8_t *buf;			///< Buffer storage.
+	uint8_t mask;			///< Buffer length minus 1 (length is power of 2).
+	volatile uint8_t head;	///< Write position (modified by producer).
+	volatile uint8_t tail;	///< Read position (modified by consumer).
+} Ring;
+/** \} */
+
+/************************************************************************//**
+ * \brief Initializes a ring buffer.
+ *
+ * \param[out] r       Ring to initialize.
+ * \param[in]  storage Buffer storage. Length must be a power of 2, and at
+ *                     most 256 bytes.
+ * \param[in]  len     Length of storage buffer.
+ *
+ * \note A ring can hold up to len - 1 bytes.
+ ****************************************************************************/
+static inline void RingInit(Ring *r, uint8_t *storage, uint16_t len) {
+	r->buf = storage;
+	r->mask = len - 1;
+	r->head = r->tail = 0;
+}
+
+/************************************************************************//**
+ * \brief Returns the number of bytes stored in the ring.
+ ****************************************************************************/
+static inline uint8_t RingCount(const Ring *r) {
+	return (r->head - r->tail) & r->mask;
+}
+
+/************************************************************************//**
+ * \brief Returns the number of bytes that can be added to the ring.
+ ****************************************************************************/
+static inline uint8_t RingFree(const Ring *r) {
+	return r->mask - RingCount(r);
+}
+
+/// Evaluates to TRUE if ring is empty
+#define RingEmpty(r)	((r)->head == (r)->tail)
+
+/// Evaluates to TRUE if ring is full
+#define RingFull(r)		(0 == RingFree(r))
+
+/************************************************************************//**
+ * \brief Adds a byte to the ring. Caller must make sure ring is not full.
+ *
+ * \param[in] r Ring to which the byte will be added.
+ * \param[in] c Byte to add.
+ ****************************************************************************/
+static inline void RingPut(Ring *r, uint8_t c) {
+	uint8_t head = r->head;
+
+	r->buf[head] = c;
+	r->head = (head + 1) & r->mask;
+}
+
+/************************************************************************//**
+ * \brief Extracts a byte from the ring. Caller must make sure ring is not
+ *        empty.
+ *
+ * \param[in] r Ring from which the byte will be extracted.
+ *
+ * \return The extracted byte.
+ ****************************************************************************/
+static inline uint8_t RingGet(Ring *r) {
+	uint8_t tail = r->tail;
+	uint8_t c;
+
+	c = r->buf[tail];
+	r->tail = (tail + 1) & r->mask;
+	return c;
+}
+
+/************************************************************************//**
+ * \brief Obtains the next byte in the ring without extracting it. Caller
+ *        must make sure ring is not empty.
+ *
+ * \param[in] r Ring to peek.
+ *
+ * \return The next byte in the ring.
+ ****************************************************************************/
+static inline uint8_t RingPeek(const Ring *r) {
+	return r->buf[r->tail];
+}
+
+/************************************************************************//**
+ * \brief Discards all the bytes in the ring. Must be called from the
+ *        consumer side.
+ ****************************************************************************/
+#define RingFlush(r)	do{(r)->tail = (r)->head;}while(0)
+
+#endif /*_RING_H_*/
+
+/** \} */
+
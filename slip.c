@@ -8,6 +8,7 @@
 
 #include "slip.h"
 #include "16c550.h"
+#include "timers.h"
 #include "util.h"
 #include <string.h>
 
@@ -41,6 +42,8 @@ typedef struct {
 	SlipStat txs;		///< Transmission state.
 	SlipStat rxs;		///< Reception state.
 	uint8_t sendEof;	///< If TRUE, EOF will be sent to end frame.
+	uint8_t rxNext;		///< TRUE if receiving a frame in several buffers.
+	SlipErrors err;		///< Link error counters.
 } SlipData;
 /** \} */
 
@@ -58,88 +61,189 @@ void SlipInit(void) {
 	memset(&d, 0, sizeof(d));
 }
 
+/************************************************************************//**
+ * \brief Flushes UART RX FIFO, and discards any received character pending
+ *        to be processed.
+ ****************************************************************************/
+void SlipFlush(void) {
+	UartFlush();
+}
+
+/************************************************************************//**
+ * \brief Enables or disables hardware (RTS/CTS) flow control. When enabled,
+ *        transmission is throttled while the peer deasserts CTS, and RTS is
+ *        deasserted while received characters pending to be processed are
+ *        about to overflow the reception buffer.
+ *
+ * \param[in] enable TRUE to enable flow control, FALSE to disable it.
+ ****************************************************************************/
+void SlipFlowCtrlSet(uint8_t enable) {
+	UartFlowCtrlSet(enable);
+}
+
+/************************************************************************//**
+ * \brief Scans the pending payload for a run of characters that do not need
+ *        to be escaped (i.e. not SLIP_SOF nor SLIP_ESC).
+ *
+ * \param[in] max Maximum length of the run to scan.
+ *
+ * \return Length of the run, starting at current transmission position.
+ ****************************************************************************/
+static inline uint8_t SlipPlainRunGet(uint8_t max) {
+	uint8_t *p = d.txb.data + d.txb.pos;
+	uint8_t run;
+
+	if ((d.txb.length - d.txb.pos) < max) max = d.txb.length - d.txb.pos;
+	for (run = 0; run < max && SLIP_SOF != p[run] && SLIP_ESC != p[run];
+			run++);
+
+	return run;
+}
+
+/************************************************************************//**
+ * \brief Queues characters of the frame being sent in the TX ring.
+ *
+ * \param[in] room Number of characters that can be added to the TX ring.
+ *
+ * \return TRUE if the frame has been completely queued, FALSE otherwise.
+ ****************************************************************************/
+static uint8_t SlipTxQueue(uint8_t room) {
+	// Character to be sent
+	uint8_t c;
+	// Length of a run of characters not needing escape
+	uint8_t run;
+	// Index
+	uint8_t i;
+
+	// Queue characters until the ring is filled
+	while (room) {
+		// Fast path: characters not needing escape are copied in runs,
+		// the state machine is only used for escapes and frame edges.
+		if ((SLIP_ST_DATA == d.txs) && (run = SlipPlainRunGet(room))) {
+			for (i = 0; i < run; i++)
+				RingPut(&uartTxRing, d.txb.data[d.txb.pos + i]);
+			d.txb.pos += run;
+			room -= run;
+			if (d.txb.pos >= d.txb.length)
+				d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
+			continue;
+		}
+		// Send data depending on status
+		switch (d.txs) {
+			case SLIP_ST_SOF:		// TX SOF character
+				c = SLIP_SOF;
+				d.txs = SLIP_ST_DATA;
+				break;
+
+			case SLIP_ST_DATA:		// TX data payload
+				// If we want to TX SOR or ESC characters, escape them
+				if (SLIP_SOF == d.txb.data[d.txb.pos]) {
+					c = SLIP_ESC;
+					d.txs = SLIP_ST_SOF_ESC;
+				} else if (SLIP_ESC == d.txb.data[d.txb.pos]) {
+					c = SLIP_ESC;
+					d.txs = SLIP_ST_ESC_ESC;
+				} else {
+					// TX character and check if we completed the frame
+					c = d.txb.data[d.txb.pos++];
+					if (d.txb.pos >= d.txb.length)
+						// If not a split frame, send EOF
+						d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
+				}
+				break;
+
+			case SLIP_ST_SOF_ESC:	// TX escaped SOF character
+				c = SLIP_SOF_ESC;
+				d.txb.pos++;
+				if (d.txb.pos >= d.txb.length)
+					d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
+				else d.txs = SLIP_ST_DATA;
+				break;
+		
+			case SLIP_ST_ESC_ESC:	// TX escaped ESC character
+				c = SLIP_ESC_ESC;
+				d.txb.pos++;
+				if (d.txb.pos >= d.txb.length)
+					d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
+				else d.txs = SLIP_ST_DATA;
+				break;
+
+			case SLIP_ST_EOF:		// TX EOF
+				c = SLIP_SOF;
+				d.txs = SLIP_ST_DONE;
+				break;
+
+			case SLIP_ST_DONE:		// TX complete.
+			default:				// We should never reach here!
+				return TRUE;
+		} // switch (d.txs)
+		RingPut(&uartTxRing, c);	// Queue the prepared character
+		room--;
+	} // while (room)
+
+	return SLIP_ST_DONE == d.txs;
+}
+
+/************************************************************************//**
+ * \brief Obtains the link error counters.
+ *
+ * \param[out] err   Link error counters.
+ * \param[in]  clear If TRUE, counters are reset after reading them.
+ ****************************************************************************/
+void SlipErrorsGet(SlipErrors *err, uint8_t clear) {
+	*err = d.err;
+	if (clear) memset(&d.err, 0, sizeof(SlipErrors));
+}
+
 /************************************************************************//**
  * \brief Continues the transmission of a data frame using SLIP protocol.
  *
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
  *         continued with SllpFrameSendCont(), or restarted by calling this
  *         function again.
  ****************************************************************************/
-uint16_t SlipFrameSendCont(uint16_t toutCount) {
-	// Number of UART check loops until a timeout condition occurs
-	uint16_t loopCount;
-	// Number of characters available in FIFO until filled
-	uint8_t fifoRoom;
-	// Character to be sent
-	uint8_t c;
+uint16_t SlipFrameSendCont(uint16_t toutMs) {
+	// Time when the wait for room in the TX ring started
+	uint16_t start;
+	// Number of characters that can be added to the TX ring
+	uint8_t room;
 
 	while (TRUE) {
-		// Wait until FIFO empty or timeout
-		for (loopCount = toutCount; !UartTxFifoEmpty() && loopCount;
-				loopCount--);
-		if (!loopCount) return d.txb.pos;
-
-		// TX up to UART_FIFO_LENGTH characters (to fill FIFO)
-		fifoRoom = UART_FIFO_LENGTH;
-		while (fifoRoom--) {
-			// Send data depending on status
-			switch (d.txs) {
-				case SLIP_ST_SOF:		// TX SOF character
-					c = SLIP_SOF;
-					d.txs = SLIP_ST_DATA;
-					break;
-
-				case SLIP_ST_DATA:		// TX data payload
-					// If we want to TX SOR or ESC characters, escape them
-					if (SLIP_SOF == d.txb.data[d.txb.pos]) {
-						c = SLIP_ESC;
-						d.txs = SLIP_ST_SOF_ESC;
-					} else if (SLIP_ESC == d.txb.data[d.txb.pos]) {
-						c = SLIP_ESC;
-						d.txs = SLIP_ST_ESC_ESC;
-					} else {
-						// TX character and check if we completed the frame
-						c = d.txb.data[d.txb.pos++];
-						if (d.txb.pos >= d.txb.length)
-							// If not a split frame, send EOF
-							d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
-					}
-					break;
-
-				case SLIP_ST_SOF_ESC:	// TX escaped SOF character
-					c = SLIP_SOF_ESC;
-					d.txb.pos++;
-					if (d.txb.pos >= d.txb.length)
-						d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
-					else d.txs = SLIP_ST_DATA;
-					break;
-			
-				case SLIP_ST_ESC_ESC:	// TX escaped ESC character
-					c = SLIP_ESC_ESC;
-					d.txb.pos++;
-					if (d.txb.pos >= d.txb.length)
-						d.txs = d.sendEof?SLIP_ST_EOF:SLIP_ST_DONE;
-					else d.txs = SLIP_ST_DATA;
-					break;
-
-				case SLIP_ST_EOF:		// TX EOF
-					c = SLIP_SOF;
-					d.txs = SLIP_ST_DONE;
-					break;
-
-				case SLIP_ST_DONE:		// TX complete.
-					return d.txb.pos;
-
-				default:
-					// We should never reach here!
-					return d.txb.pos;
-			} // switch (d.txs)
-			UartPutchar(c);				// Send the prepared character
-		} // while (fifoRoom--)
-	} // while (TRUE)
+		// Wait until there is room in the TX ring or timeout. Meanwhile,
+		// pump the UART for the ring to drain as fast as possible.
+		for (start = TimerMsGet(); !(room = RingFree(&uartTxRing));
+				UartPump()) {
+			if (TimerMsElapsed(start) >= toutMs) {
+				SatInc(d.err.txTout);
+				return d.txb.pos;
+			}
+		}
+
+		if (SlipTxQueue(room)) {
+			// Start sending without waiting for the pump interrupt
+			UartPump();
+			return d.txb.pos;
+		}
+	}
+}
+
+/************************************************************************//**
+ * \brief Queues as much of the frame being sent as fits in the TX ring,
+ *        without waiting. Allows doing other tasks (e.g. receiving more
+ *        data to send) while the frame is transmitted.
+ *
+ * \return Number of payload bytes pending to be queued. For split frames,
+ *         0 means the data passed to SlipSplitFrameAppendStart() has been
+ *         completely queued.
+ ****************************************************************************/
+uint16_t SlipFrameSendStep(void) {
+	SlipTxQueue(RingFree(&uartTxRing));
+	UartPump();
+
+	return d.txb.length - d.txb.pos;
 }
 
 
@@ -147,14 +251,22 @@ uint16_t SlipFrameSendCont(uint16_t toutCount) {
 /************************************************************************//**
  * \brief Sends the SOF character, marking the start of a split frame send.
  *
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if SOF was successfully sent, 1 otherwise.
  ****************************************************************************/
-uint8_t SlipSplitFrameSendSof(uint16_t toutCount) {
-	while(!UartTxFifoEmpty() && toutCount--);
-	if (!toutCount) return 1;
-	UartPutchar(SLIP_SOF);
+uint8_t SlipSplitFrameSendSof(uint16_t toutMs) {
+	uint16_t start = TimerMsGet();
+
+	while(RingFull(&uartTxRing)) {
+		if (TimerMsElapsed(start) >= toutMs) {
+			SatInc(d.err.txTout);
+			return 1;
+		}
+		UartPump();
+	}
+	RingPut(&uartTxRing, SLIP_SOF);
+	UartPump();
 	return 0;
 }
 
@@ -168,7 +280,7 @@ uint8_t SlipSplitFrameSendSof(uint16_t toutCount) {
  *
  * \param[in] data      Buffer with the data to send.
  * \param[in] len       Number of bytes to send.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
@@ -176,15 +288,27 @@ uint8_t SlipSplitFrameSendSof(uint16_t toutCount) {
  *         function again.
  ****************************************************************************/
 uint16_t SlipSplitFrameAppendPoll(uint8_t *data, uint16_t len,
-		uint16_t toutCount) {
+		uint16_t toutMs) {
+	SlipSplitFrameAppendStart(data, len);
+
+	// Send the new frame
+	return SlipFrameSendCont(toutMs);
+}
+
+/************************************************************************//**
+ * \brief Prepares data to be appended to a split frame, but does not send
+ *        it. Data is then queued for sending by calling SlipFrameSendStep()
+ *        until it returns 0. Data buffer must not be modified until then.
+ *
+ * \param[in] data Buffer with the data to send.
+ * \param[in] len  Number of bytes to send. Must be greater than 0.
+ ****************************************************************************/
+void SlipSplitFrameAppendStart(uint8_t *data, uint16_t len) {
 	d.txb.data = data;
 	d.txb.length = len;
 	d.txb.pos = 0;
 	d.sendEof = FALSE;
 	d.txs = SLIP_ST_DATA;
-
-	// Receive the new frame
-	return SlipFrameSendCont(toutCount);
 }
 
 /************************************************************************//**
@@ -192,7 +316,7 @@ uint16_t SlipSplitFrameAppendPoll(uint8_t *data, uint16_t len,
  *
  * \param[in] data      Buffer with the data to send.
  * \param[in] len       Number of bytes to send.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
@@ -201,7 +325,7 @@ uint16_t SlipSplitFrameAppendPoll(uint8_t *data, uint16_t len,
  * \warning If there was a half sent frame, calling this function aborts the
  *         half sent frame and starts sending the new one.
  ****************************************************************************/
-uint16_t SlipFrameSendPoll(uint8_t *data, uint16_t len, uint16_t toutCount) {
+uint16_t SlipFrameSendPoll(uint8_t *data, uint16_t len, uint16_t toutMs) {
 	// Prepare to send frame and don't look back (if there was a half sent
 	// frame, it will be lost).
 	d.txb.data = data;
@@ -211,32 +335,46 @@ uint16_t SlipFrameSendPoll(uint8_t *data, uint16_t len, uint16_t toutCount) {
 	d.sendEof = TRUE;
 
 	// Receive the new frame
-	return SlipFrameSendCont(toutCount);
+	return SlipFrameSendCont(toutMs);
 }
 
 /************************************************************************//**
  * \brief Continues receiving a data frame using SLIP protocol.
  *
  * \param[out] length   Length of the received frame.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if a complete frame was received, 1 if a timeout occurred,
  *         2 if reception was aborted because buffer was filled before
  *         receiving the EOF, or greater if other reception error occurred.
  ****************************************************************************/
-uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutCount) {
-	// Number of UART check loops until a timeout condition occurs
-	uint16_t loopCount;
+uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutMs) {
+	// Time when the wait for received data started
+	uint16_t start;
 	// Character to be sent
 	uint8_t c;
 
 	while (TRUE) {
-		// Wait until there is data on the UART or timeout
-		for (loopCount = toutCount; !UartRxFifoData() && loopCount;
-				loopCount--);
-		if (!loopCount) return 1;
+		// Wait until there is data on the RX ring or timeout. Meanwhile,
+		// pump the UART instead of waiting for the pump interrupt.
+		for (start = TimerMsGet(); RingEmpty(&uartRxRing); UartPump()) {
+			if (TimerMsElapsed(start) >= toutMs) {
+				SatInc(d.err.rxTout);
+				*length = d.rxb.pos;
+				return 1;
+			}
+		}
+		// If buffer is full, only EOF can be processed. Otherwise leave
+		// the character in the ring, for SlipFrameRecvNext() to get it.
+		if ((d.rxb.pos >= d.rxb.length) && (SLIP_ST_SOF != d.rxs) &&
+				!((SLIP_ST_DATA == d.rxs) &&
+				(SLIP_SOF == RingPeek(&uartRxRing)))) {
+			SatInc(d.err.rxOvfw);
+			*length = d.rxb.pos;
+			return 2;
+		}
 		// Receive data depending on state
-		c = UartGetchar();
+		c = RingGet(&uartRxRing);
 		switch (d.rxs) {
 			case SLIP_ST_SOF:			// Wait until SOF received
 				// Silently discard data until SOF received
@@ -247,47 +385,38 @@ uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutCount) {
 				// Check special case: if we receive an EOF, and pos == 0,
 				// it means that this is indeed a SOF, and previous SOF
 				// was instead an EOF. Otherwise, it's an EOF.
-				if (SLIP_SOF == c && d.rxb.pos) {
+				if (SLIP_SOF == c && (d.rxb.pos || d.rxNext)) {
 					*length = d.rxb.pos;
 					return 0;
 				}
 				// Check for ESC character
 				else if (SLIP_ESC == c) d.rxs = SLIP_ST_ESC_ESC;
-				else if (SLIP_SOF != c) {
-					// Check if buffer is full
-					if (d.rxb.pos >= d.rxb.length) {
-						*length = d.rxb.pos;
-						return 2;
-					}
-					// There's room in the buffer, copy character
-					d.rxb.data[d.rxb.pos++] = c;
-				}
+				// There's room in the buffer, copy character
+				else if (SLIP_SOF != c) d.rxb.data[d.rxb.pos++] = c;
 				break;
 
 			case SLIP_ST_ESC_ESC:		// Receive escaped character
 				if (SLIP_SOF_ESC == c) c = SLIP_SOF;
-				else if (SLIP_ST_ESC_ESC == c) c = SLIP_ESC;
+				else if (SLIP_ESC_ESC == c) c = SLIP_ESC;
 				else {
 					// An error has occurred, an escape character should
 					// be followed by SOF or ESC escape codes only.
+					SatInc(d.err.rxErr);
 					*length = d.rxb.pos;
 					return 3;
 				}
-				// Check if buffer is full
-				if (d.rxb.pos >= d.rxb.length) {
-					*length = d.rxb.pos;
-					return 2;
-				}
 				// There's room in the buffer, copy character
 				d.rxb.data[d.rxb.pos++] = c;
+				d.rxs = SLIP_ST_DATA;
 				break;
 
 			default:
 				// Should never reach here!
+				SatInc(d.err.rxErr);
 				*length = d.rxb.pos;
 				return 3;
 		}
-	} // while (loopCount)
+	} // while (TRUE)
 }
 
 /************************************************************************//**
@@ -296,14 +425,14 @@ uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutCount) {
  * \param[in] data      Buffer that will hold the received frame.
  * \param[in] max       Lenght of data buffer (maximum bytes to receive).
  * \param[out] length   Length of the received frame.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if a complete frame was received, 1 if a timeout occurred,
  *         2 if reception was aborted because buffer was filled before
  *         receiving the EOF, or greater if other reception error occurred.
  ****************************************************************************/
 uint16_t SlipFrameRecvPoll(uint8_t *data, uint16_t max, uint16_t *length,
-		uint16_t toutCount) {
+		uint16_t toutMs) {
 
 	// Prepare to receive frame and don't look back (if there was a half
 	// received frame, it will be lost).
@@ -311,7 +440,33 @@ uint16_t SlipFrameRecvPoll(uint8_t *data, uint16_t max, uint16_t *length,
 	d.rxb.length = max;
 	d.rxb.pos = 0;
 	d.rxs = SLIP_ST_SOF;
+	d.rxNext = FALSE;
+
+	return SlipFrameRecvCont(length, toutMs);
+}
+
+/************************************************************************//**
+ * \brief Continues receiving a frame using a new buffer, after a reception
+ *        function returned 2 because the previous buffer was filled. No
+ *        data is lost, so frames larger than the buffer can be received in
+ *        several pieces.
+ *
+ * \param[in] data      Buffer that will hold the next piece of the frame.
+ * \param[in] max       Lenght of data buffer (maximum bytes to receive).
+ * \param[out] length   Length of the received piece.
+ * \param[in] toutMs    Timeout in milliseconds.
+ *
+ * \return 0 if the frame was completed, 1 if a timeout occurred, 2 if the
+ *         buffer was filled before receiving the EOF, or greater if other
+ *         reception error occurred.
+ ****************************************************************************/
+uint16_t SlipFrameRecvNext(uint8_t *data, uint16_t max, uint16_t *length,
+		uint16_t toutMs) {
+	d.rxb.data = data;
+	d.rxb.length = max;
+	d.rxb.pos = 0;
+	d.rxNext = TRUE;
 
-	return SlipFrameRecvCont(length, toutCount);
+	return SlipFrameRecvCont(length, toutMs);
 }
 
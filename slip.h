@@ -25,6 +25,16 @@
 #define SLIP_ESC_ESC	0xDD
 /** \} */
 
+/** \addtogroup slip SlipErrors Link error counters.
+ *  \{ */
+typedef struct {
+	uint16_t rxTout;	///< Reception timeouts.
+	uint16_t rxOvfw;	///< Frames not fitting in the reception buffer.
+	uint16_t rxErr;		///< Frame decoding errors.
+	uint16_t txTout;	///< Transmission timeouts.
+} SlipErrors;
+/** \} */
+
 /************************************************************************//**
  * \brief Module initialization. Must be called once before using any other
  *        function in this module.
@@ -34,13 +44,38 @@
  ****************************************************************************/
 void SlipInit(void);
 
+/************************************************************************//**
+ * \brief Flushes UART RX FIFO, and discards any received character pending
+ *        to be processed.
+ ****************************************************************************/
+void SlipFlush(void);
+
+/************************************************************************//**
+ * \brief Enables or disables hardware (RTS/CTS) flow control. When enabled,
+ *        transmission is throttled while the peer deasserts CTS, and RTS is
+ *        deasserted while received characters pending to be processed are
+ *        about to overflow the reception buffer.
+ *
+ * \param[in] enable TRUE to enable flow control, FALSE to disable it.
+ *
+ * \note Flow control is disabled each time the UART is initialized.
+ ****************************************************************************/
+void SlipFlowCtrlSet(uint8_t enable);
+
+/************************************************************************//**
+ * \brief Obtains the link error counters.
+ *
+ * \param[out] err   Link error counters.
+ * \param[in]  clear If TRUE, counters are reset after reading them.
+ ****************************************************************************/
+void SlipErrorsGet(SlipErrors *err, uint8_t clear);
+
 /************************************************************************//**
  * \brief Sends a data frame using SLIP protocol.
  *
  * \param[in] data      Buffer with the data to send.
  * \param[in] len       Number of bytes to send.
- * \param[in] toutCount Maximum loop count without being able to send a
- *                      character.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
@@ -49,19 +84,30 @@ void SlipInit(void);
  * \warning If there was a half sent frame, calling this function aborts the
  *         half sent frame and starts sending the new one.
  ****************************************************************************/
-uint16_t SlipFrameSendPoll(uint8_t *data, uint16_t len, uint16_t toutCount);
+uint16_t SlipFrameSendPoll(uint8_t *data, uint16_t len, uint16_t toutMs);
 
 /************************************************************************//**
  * \brief Continues the transmission of a data frame using SLIP protocol.
  *
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
  *         continued with SllpFrameSendCont(), or restarted by calling this
  *         function again.
  ****************************************************************************/
-uint16_t SlipFrameSendCont(uint16_t toutCount);
+uint16_t SlipFrameSendCont(uint16_t toutMs);
+
+/************************************************************************//**
+ * \brief Queues as much of the frame being sent as fits in the TX ring,
+ *        without waiting. Allows doing other tasks (e.g. receiving more
+ *        data to send) while the frame is transmitted.
+ *
+ * \return Number of payload bytes pending to be queued. For split frames,
+ *         0 means the data passed to SlipSplitFrameAppendStart() has been
+ *         completely queued.
+ ****************************************************************************/
+uint16_t SlipFrameSendStep(void);
 
 /************************************************************************//**
  * \brief Receives a data frame using SLIP protocol.
@@ -69,35 +115,53 @@ uint16_t SlipFrameSendCont(uint16_t toutCount);
  * \param[in] data      Buffer that will hold the received frame.
  * \param[in] max       Lenght of data buffer (maximum bytes to receive).
  * \param[out] length   Length of the received frame.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if a complete frame was received, 1 if a timeout occurred,
  *         2 if reception was aborted because buffer was filled before
  *         receiving the EOF, or greater if other reception error occurred.
  ****************************************************************************/
 uint16_t SlipFrameRecvPoll(uint8_t *data, uint16_t max, uint16_t *length,
-		uint16_t toutCount);
+		uint16_t toutMs);
 
 /************************************************************************//**
  * \brief Continues receiving a data frame using SLIP protocol.
  *
  * \param[out] length   Length of the received frame.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if a complete frame was received, 1 if a timeout occurred,
  *         2 if reception was aborted because buffer was filled before
  *         receiving the EOF, or greater if other reception error occurred.
  ****************************************************************************/
-uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutCount);
+uint16_t SlipFrameRecvCont(uint16_t *length, uint16_t toutMs);
+
+/************************************************************************//**
+ * \brief Continues receiving a frame using a new buffer, after a reception
+ *        function returned 2 because the previous buffer was filled. No
+ *        data is lost, so frames larger than the buffer can be received in
+ *        several pieces.
+ *
+ * \param[in] data      Buffer that will hold the next piece of the frame.
+ * \param[in] max       Lenght of data buffer (maximum bytes to receive).
+ * \param[out] length   Length of the received piece.
+ * \param[in] toutMs    Timeout in milliseconds.
+ *
+ * \return 0 if the frame was completed, 1 if a timeout occurred, 2 if the
+ *         buffer was filled before receiving the EOF, or greater if other
+ *         reception error occurred.
+ ****************************************************************************/
+uint16_t SlipFrameRecvNext(uint8_t *data, uint16_t max, uint16_t *length,
+		uint16_t toutMs);
 
 /************************************************************************//**
  * \brief Sends the SOF character, marking the start of a split frame send.
  *
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if SOF was successfully sent, 1 otherwise.
  ****************************************************************************/
-uint8_t SlipSplitFrameSendSof(uint16_t toutCount);
+uint8_t SlipSplitFrameSendSof(uint16_t toutMs);
 
 /************************************************************************//**
  * \brief Sends data through the data link, using SLIP protocol. When using
@@ -109,7 +173,7 @@ uint8_t SlipSplitFrameSendSof(uint16_t toutCount);
  *
  * \param[in] data      Buffer with the data to send.
  * \param[in] len       Number of bytes to send.
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return The number of bytes sent. Should equal len, unless a timeout
  *         condition has occurred. If timeout occurs, transmission can be
@@ -117,16 +181,26 @@ uint8_t SlipSplitFrameSendSof(uint16_t toutCount);
  *         function again.
  ****************************************************************************/
 uint16_t SlipSplitFrameAppendPoll(uint8_t *data, uint16_t len,
-		uint16_t toutCount);
+		uint16_t toutMs);
+
+/************************************************************************//**
+ * \brief Prepares data to be appended to a split frame, but does not send
+ *        it. Data is then queued for sending by calling SlipFrameSendStep()
+ *        until it returns 0. Data buffer must not be modified until then.
+ *
+ * \param[in] data Buffer with the data to send.
+ * \param[in] len  Number of bytes to send. Must be greater than 0.
+ ****************************************************************************/
+void SlipSplitFrameAppendStart(uint8_t *data, uint16_t len);
 
 /************************************************************************//**
  * \brief Sends the EOF character, marking the end of a split frame send.
  *
- * \param[in] toutCount Maximum loop count until timeout condition.
+ * \param[in] toutMs    Timeout in milliseconds.
  *
  * \return 0 if EOF was successfully sent, 1 otherwise.
  ****************************************************************************/
-#define SlipSplitFrameSendEof(toutCount) SlipSplitFrameSendSof(toutCount)
+#define SlipSplitFrameSendEof(toutMs) SlipSplitFrameSendSof(toutMs)
 
 #endif /*_SLIP_H_*/
 
@@ -13,23 +13,17 @@
 #include "bloader.h"
 #include "slip.h"
 #include "wifi-if.h"
+#include "esp-bl.h"
+#include "cdc-bridge.h"
+#include "wifi-cmdq.h"
+#include "mdma-fw.h"
+#include "pt.h"
 #include <LUFA//Drivers/USB/USB.h>
 #include <Descriptors.h>
 #include <string.h>
 #include <LUFA/Drivers/Board/LEDs.h>
 #include <avr/cpufunc.h>
-
-/// Command and data bytes for the ESP8266 SYNC command.
-const char syncFrame[] = {
-	// 0, cmd, data_len, data_len (16b), chk (32b)
-	0x00, 0x08, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00,
-	// data
-	0x07, 0x07, 0x12, 0x20,
-	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 
-	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 
-	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
-	0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55
-};
+#include <util/atomic.h>
 
 /** \addtogroup sys_fsm PortDefs Port definitions for the programmer board.
  * \{ */
@@ -53,6 +47,25 @@ const char syncFrame[] = {
 /// even though the buffer length is larger than the stack. Welcome to 2016!
 static uint8_t buf[MAX(VENDOR_O_EPSIZE, VENDOR_I_EPSIZE)];
 
+/// Block buffer for MDMA_WIFI_FLASH command. Must hold an integer number of
+/// USB packets.
+static uint8_t espBlk[ESP_BL_FLASH_BLOCK_LEN];
+#if ESP_BL_FLASH_BLOCK_LEN % VENDOR_O_EPSIZE
+#error "ESP_BL_FLASH_BLOCK_LEN must be a multiple of VENDOR_O_EPSIZE"
+#endif
+
+/// Module output capture state. While capture is enabled, captured
+/// characters are stored in espBlk, so commands using it are refused.
+static struct {
+	uint16_t head;		///< Oldest captured character in espBlk.
+	uint16_t count;		///< Characters captured.
+	uint16_t dropped;	///< Characters lost because espBlk was full.
+} cap;
+
+/// Second buffer for long WiFi commands. Next USB packet is received here
+/// while the previous one is being sent to the WiFi module.
+static uint8_t pipeBuf[VENDOR_O_EPSIZE];
+
 /************************************************************************//**
  * \brief Write a word using little endian order, guarantees proper
  * operation even when using unaligned addresses.
@@ -64,9 +77,61 @@ inline void SfUnalignWordWrite(uint8_t dest[], uint16_t src) {
 	dest[0] = src;
 	dest[1] = src>>8;
 }
+
+/************************************************************************//**
+ * \brief Write a dword using little endian order, guarantees proper
+ * operation even when using unaligned addresses.
+ *
+ * \param[out] dest Destination to which write the dword.
+ * \param[in]  src  Source dword
+ ****************************************************************************/
+static inline void SfUnalignDwordWrite(uint8_t dest[], uint32_t src) {
+	SfUnalignWordWrite(dest, src);
+	SfUnalignWordWrite(dest + 2, src>>16);
+}
 // System FSM data
 static SfInstance si;
 
+/// Long command task data
+static struct {
+	Pt pt;			///< Protothread resume point.
+	uint32_t addr;	///< Flash word address.
+	uint16_t length;///< Words pending.
+	SfStat s;		///< State the task runs in.
+	uint8_t err;	///< TRUE if an error occurred.
+	uint8_t active;	///< TRUE while the task is running.
+} task;
+
+/// Progress of the running (or last) long command, see MDMA_CTRL_PROGRESS
+static struct {
+	uint32_t done;	///< Words (flash) or bytes (WiFi) processed.
+	uint8_t cmd;	///< Command running, 0 if none.
+	uint8_t aborted;///< TRUE if last command was aborted by host.
+} prog;
+
+/// Set by the MDMA_CTRL_ABORT control request
+static volatile uint8_t hostAbort;
+
+/// Pending events, one bit per event (see SF_EVT_BIT)
+static volatile uint16_t evtPend;
+
+/// Millisecond clock value when each event was last posted
+static uint16_t evtTime[SF_EVT_NUM];
+
+/// Events in priority order, highest first
+static const uint8_t evtPrio[SF_EVT_NUM] = {
+	SF_EVT_COUT, SF_EVT_USB_DET, SF_EVT_USB_ERR, SF_EVT_CIN, SF_EVT_USB_ATT,
+	SF_EVT_TIMER, SF_EVT_SW_PRESS, SF_EVT_SW_REL, SF_EVT_DOUT, SF_EVT_DIN,
+	SF_EVT_NONE
+};
+
+/// USB IN and OUT wait event counters
+static struct {
+	uint16_t inWait;	///< IN endpoint not ready when sending.
+	uint16_t outWait;	///< OUT data not received when reading.
+	uint16_t err;		///< Endpoint stream errors (timeouts, stalls).
+} usbStats;
+
 /************************************************************************//**
  * \brief Module initialization. Must be called before using any other
  * function from this module.
@@ -92,7 +157,9 @@ void SfInit(void) {
 static inline void SfDataRecv(uint8_t data[]) {
 	// We do not need to select endpoint, as it has been previously
 	// selected to check if there is incoming data
-	Endpoint_Read_Stream_LE(data, VENDOR_O_EPSIZE, NULL);
+	if (!Endpoint_IsOUTReceived()) SatInc(usbStats.outWait);
+	if (Endpoint_Read_Stream_LE(data, VENDOR_O_EPSIZE, NULL))
+		SatInc(usbStats.err);
 	Endpoint_ClearOUT();
 }
 
@@ -105,10 +172,339 @@ static inline void SfDataRecv(uint8_t data[]) {
 static inline void SfDataSend(uint8_t data[], uint16_t len) {
 	memset(data+len, 0, VENDOR_I_EPSIZE-len);
 	Endpoint_SelectEndpoint(VENDOR_IN_EPADDR);
-	Endpoint_Write_Stream_LE(data, VENDOR_I_EPSIZE, NULL);
+	if (!Endpoint_IsINReady()) SatInc(usbStats.inWait);
+	if (Endpoint_Write_Stream_LE(data, VENDOR_I_EPSIZE, NULL))
+		SatInc(usbStats.err);
 	Endpoint_ClearIN();
 }
 
+/************************************************************************//**
+ * \brief Starts tracking the progress of a long command. Clears any abort
+ *        request received before the command started.
+ *
+ * \param[in] cmd Command to track.
+ ****************************************************************************/
+static void SfProgStart(uint8_t cmd) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		prog.cmd = cmd;
+		prog.done = 0;
+		prog.aborted = FALSE;
+		hostAbort = FALSE;
+	}
+}
+
+/************************************************************************//**
+ * \brief Updates the progress of the running long command.
+ *
+ * \param[in] done Words or bytes processed.
+ ****************************************************************************/
+static void SfProgSet(uint32_t done) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		prog.done = done;
+	}
+}
+
+/************************************************************************//**
+ * \brief Ends tracking the progress of the running long command.
+ ****************************************************************************/
+static void SfProgEnd(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		prog.aborted = hostAbort;
+		prog.cmd = 0;
+		hostAbort = FALSE;
+	}
+}
+
+/// Evaluates to TRUE if host requested aborting the running command
+#define SfHostAbort()	(hostAbort)
+
+/************************************************************************//**
+ * \brief Resets the flash chip to read-array mode after an aborted command,
+ *        pausing the UART pump during the flash access.
+ ****************************************************************************/
+static void SfFlashAbort(void) {
+	UartPumpPause();
+	FlashReset();
+	UartPumpResume();
+}
+
+/************************************************************************//**
+ * \brief Checks the status of a chip erase, pausing the UART pump during
+ *        the flash access.
+ *
+ * \return The erase status, see FlashEraseStat().
+ ****************************************************************************/
+static uint8_t SfEraseStat(void) {
+	uint8_t stat;
+
+	UartPumpPause();
+	stat = FlashEraseStat(0);
+	UartPumpResume();
+
+	return stat;
+}
+
+/************************************************************************//**
+ * \brief Writes a block of words to the flash chip, in chunks of up to 16
+ *        words, not crossing write-buffer boundaries.
+ *
+ * \param[in] addr Word address to write to.
+ * \param[in] data Words to write.
+ * \param[in] len  Number of words to write.
+ *
+ * \return Number of words written. Less than len if an error occurred.
+ ****************************************************************************/
+static uint8_t SfFlashWrite(uint32_t addr, uint16_t data[], uint8_t len) {
+	uint8_t i, toWrite, written;
+
+	// Write data in blocks of max 16 words. The first write takes care of
+	// avoiding crossing a 16-word write-buffer boundary. Following writes
+	// are guaranteed not to cross it.
+	toWrite = MIN(len, 16 - (addr&0xF));
+	i = FlashWriteBuf(addr, data, toWrite);
+	if (i == toWrite) {
+		addr += i;
+		// First write is OK, write remaining data
+		while (i < len) {
+			toWrite = MIN(len - i, 16);
+			written = FlashWriteBuf(addr, data + i, toWrite);
+			i += written;
+			addr += written;
+			// Check for errors
+			if (written != toWrite) break;
+		}
+	}
+
+	return i;
+}
+
+/************************************************************************//**
+ * \brief Checks if the vendor IN endpoint can take a packet.
+ ****************************************************************************/
+static inline uint8_t SfInReady(void) {
+	Endpoint_SelectEndpoint(VENDOR_IN_EPADDR);
+	return Endpoint_IsINReady();
+}
+
+/************************************************************************//**
+ * \brief Checks if a packet has been received on the vendor OUT endpoint.
+ *        The endpoint is left selected.
+ ****************************************************************************/
+static inline uint8_t SfOutReceived(void) {
+	Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
+	return Endpoint_IsOUTReceived();
+}
+
+/************************************************************************//**
+ * \brief Flash read task: sends an IN packet with flash data each time the
+ *        endpoint is ready. Stops if the cart is removed or on host abort.
+ *
+ * \return PT_WAITING while running, PT_ENDED when finished.
+ ****************************************************************************/
+static uint8_t SfReadTask(void) {
+	uint8_t i, step;
+
+	PT_BEGIN(&task.pt);
+	while (task.length && (SF_CART_READ == si.s)) {
+		PT_WAIT_UNTIL(&task.pt, SfInReady() || (SF_CART_READ != si.s) ||
+				!si.f.usb_ready || SfHostAbort());
+		if ((SF_CART_READ != si.s) || !si.f.usb_ready) break;
+		if (SfHostAbort()) {
+			SfFlashAbort();
+			break;
+		}
+		step = MIN(task.length, VENDOR_I_EPSIZE>>1);
+		UartPumpPause();
+		for (i = 0; i < step; i++, task.addr++)
+			((uint16_t*)buf)[i] = FlashRead(task.addr);
+		UartPumpResume();
+		task.length -= step;
+		SfDataSend(buf, step<<1);
+		SfProgSet(prog.done + step);
+	}
+	PT_END(&task.pt);
+}
+
+/************************************************************************//**
+ * \brief Flash write task: programs each OUT packet received. If the cart
+ *        is removed, a write fails or host aborts, packets are still
+ *        received (but not written) until the requested length is
+ *        completed, so they are not taken as commands. On host abort, the
+ *        flash chip is reset to read-array mode before draining.
+ *
+ * \return PT_WAITING while running, PT_ENDED when finished.
+ ****************************************************************************/
+static uint8_t SfWriteTask(void) {
+	uint8_t step;
+
+	PT_BEGIN(&task.pt);
+	while (task.length) {
+		PT_WAIT_UNTIL(&task.pt, SfOutReceived() || !si.f.usb_ready);
+		if (!si.f.usb_ready) break;
+		SfDataRecv(buf);
+		// On abort, reset the chip once, then only drain host data
+		if (SfHostAbort() && !task.err) {
+			SfFlashAbort();
+			task.err = TRUE;
+		}
+		step = MIN(task.length, VENDOR_O_EPSIZE>>1);
+		if ((SF_CART_PROG == si.s) && !task.err) {
+			UartPumpPause();
+			if (SfFlashWrite(task.addr, (uint16_t*)buf, step) != step)
+				task.err = TRUE;
+			UartPumpResume();
+			task.addr += step;
+			if (!task.err) SfProgSet(prog.done + step);
+		}
+		task.length -= step;
+	}
+	PT_END(&task.pt);
+}
+
+/************************************************************************//**
+ * \brief Chip erase task: waits until erase finishes, and sends the reply.
+ *        Chip erase cannot be interrupted, so host abort requests are
+ *        ignored.
+ *
+ * \return PT_WAITING while running, PT_ENDED when finished.
+ ****************************************************************************/
+static uint8_t SfEraseTask(void) {
+	uint8_t stat = FLASH_ERASE_ERR;
+
+	PT_BEGIN(&task.pt);
+	PT_WAIT_UNTIL(&task.pt, (SF_CART_ERASE != si.s) ||
+			(FLASH_ERASE_BUSY != (stat = SfEraseStat())));
+	buf[0] = (FLASH_ERASE_OK == stat)?MDMA_OK:MDMA_ERR;
+	SfDataSend(buf, 1);
+	PT_END(&task.pt);
+}
+
+/************************************************************************//**
+ * \brief WiFi SYNC task: performs a SYNC attempt on each step, until the
+ *        bootloader answers, attempts are exhausted, the cart is removed or
+ *        host aborts. Then sends the reply.
+ *
+ * \return PT_WAITING while running, PT_ENDED when finished.
+ ****************************************************************************/
+static uint8_t SfSyncTask(void) {
+	PT_BEGIN(&task.pt);
+	task.err = TRUE;
+	while (task.length && (SF_WIFI_MOD == si.s) && !SfHostAbort()) {
+		task.length--;
+		if (ESP_BL_OK == EspBlSync(1)) {
+			task.err = FALSE;
+			break;
+		}
+		SfProgSet(prog.done + 1);
+		PT_YIELD(&task.pt);
+	}
+	buf[0] = task.err?MDMA_ERR:MDMA_OK;
+	SfDataSend(buf, 1);
+	PT_END(&task.pt);
+}
+
+/************************************************************************//**
+ * \brief Starts a long command task. The system stays in the specified
+ *        state until the task finishes.
+ *
+ * \param[in] s   State corresponding to the task.
+ * \param[in] cmd Command that started the task, for progress reporting.
+ ****************************************************************************/
+static void SfTaskStart(SfStat s, uint8_t cmd) {
+	SfProgStart(cmd);
+	PT_INIT(&task.pt);
+	task.s = si.s = s;
+	task.err = FALSE;
+	task.active = TRUE;
+}
+
+/************************************************************************//**
+ * \brief Runs a step of the active long command task (if any). Must be
+ *        called from the main loop.
+ ****************************************************************************/
+void SfTaskStep(void) {
+	uint8_t stat;
+
+	if (!task.active) return;
+
+	if (SF_CART_READ == task.s) stat = SfReadTask();
+	else if (SF_CART_PROG == task.s) stat = SfWriteTask();
+	else if (SF_CART_ERASE == task.s) stat = SfEraseTask();
+	else stat = SfSyncTask();
+
+	if (PT_ENDED == stat) {
+		task.active = FALSE;
+		SfProgEnd();
+		// Return to READY, unless state changed (e.g. cart removed)
+		if (task.s == si.s) si.s = SF_READY;
+	}
+}
+
+/************************************************************************//**
+ * \brief Checks if a long command task is running. While running, host
+ *        data must not be processed as commands.
+ *
+ * \return TRUE if a task is running, FALSE otherwise.
+ ****************************************************************************/
+uint8_t SfTaskBusy(void) {
+	return task.active;
+}
+
+/************************************************************************//**
+ * \brief Moves module output received by the UART to the capture buffer,
+ *        while capture is enabled. Characters that do not fit are counted
+ *        as dropped.
+ ****************************************************************************/
+void SfCaptureTask(void) {
+	uint8_t c;
+
+	// Replies to a running task or to queued commands are not module output
+	if (!UartCaptureOn() || task.active || WiFiCmdQPending()) return;
+
+	while (!RingEmpty(&uartRxRing)) {
+		c = RingGet(&uartRxRing);
+		if (cap.count < ESP_BL_FLASH_BLOCK_LEN) {
+			espBlk[(cap.head + cap.count) % ESP_BL_FLASH_BLOCK_LEN] = c;
+			cap.count++;
+		} else if (cap.dropped < UINT16_MAX) {
+			cap.dropped++;
+		}
+	}
+}
+
+/************************************************************************//**
+ * \brief Builds the reply to the MDMA_LINK_STATS command.
+ *
+ * \param[inout] data Buffer with the command. If data[1] is not 0,
+ *                    counters are reset once read. On return it holds
+ *                    the reply.
+ *
+ * \return Reply length.
+ ****************************************************************************/
+static uint16_t SfLinkStatsGet(uint8_t data[]) {
+	UartErrors ue;
+	SlipErrors se;
+	uint8_t clear = data[1];
+	uint8_t *p = data + 1;
+
+	UartErrorsGet(&ue, clear);
+	SlipErrorsGet(&se, clear);
+	SfUnalignWordWrite(p, ue.overrun); p += 2;
+	SfUnalignWordWrite(p, ue.parity);  p += 2;
+	SfUnalignWordWrite(p, ue.framing); p += 2;
+	SfUnalignWordWrite(p, se.rxTout);  p += 2;
+	SfUnalignWordWrite(p, se.rxOvfw);  p += 2;
+	SfUnalignWordWrite(p, se.rxErr);   p += 2;
+	SfUnalignWordWrite(p, se.txTout);  p += 2;
+	SfUnalignWordWrite(p, usbStats.inWait);  p += 2;
+	SfUnalignWordWrite(p, usbStats.outWait); p += 2;
+	SfUnalignWordWrite(p, usbStats.err);     p += 2;
+	if (clear) memset(&usbStats, 0, sizeof(usbStats));
+	data[0] = MDMA_OK;
+
+	return p - data;
+}
+
 /************************************************************************//**
  * \brief Read/write to GPIO pins. Input/output parameters take a byte for
  * each port from PORTA to PORTF.
@@ -189,6 +585,240 @@ void SfGpioAction(uint8_t mask[], uint8_t r_w[], uint8_t value[], uint8_t readed
 	}
 }
 
+/************************************************************************//**
+ * \brief Forwards the payload of a long command to the WiFi module, inside
+ *        a split SLIP frame. Payload is received in several USB packets,
+ *        using two buffers: while a packet is being sent through the UART,
+ *        the next one is received.
+ *
+ * \param[in] data Buffer for receiving the payload (VENDOR_O_EPSIZE bytes).
+ * \param[in] len  Payload length.
+ *
+ * \return 0 if payload was completely sent, 1 on timeout.
+ * \note EOF is not sent, SlipSplitFrameSendEof() must be called afterwards.
+ ****************************************************************************/
+static uint8_t SfWiFiLongFwd(uint8_t data[], uint16_t len) {
+	uint8_t *pkt[2] = {data, pipeBuf};
+	// Buffer being sent
+	uint8_t cur = 0;
+	// Length of the packet received in the other buffer, 0 if none
+	uint8_t next = 0;
+	// Payload bytes received from USB
+	uint16_t recvd;
+	// Payload bytes pending to be queued, and value on previous iteration
+	uint16_t pend, prev;
+	// Time of last progress, for timeout computation
+	uint16_t start;
+
+	if (SlipSplitFrameSendSof(SF_WIFI_CMD_TOUT_MS)) return 1;
+	if (!len) return 0;
+	Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
+	SfDataRecv(data);
+	recvd = prev = MIN(VENDOR_O_EPSIZE, len);
+	SlipSplitFrameAppendStart(data, recvd);
+
+	for (start = TimerMsGet(); TimerMsElapsed(start) < SF_WIFI_CMD_TOUT_MS;) {
+		pend = SlipFrameSendStep();
+		// Receive next packet while current one is being sent
+		if (!next && recvd < len) {
+			Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
+			if (Endpoint_IsOUTReceived()) {
+				SfDataRecv(pkt[cur ^ 1]);
+				next = MIN(VENDOR_O_EPSIZE, len - recvd);
+				recvd += next;
+				start = TimerMsGet();
+			}
+		}
+		if (!pend) {
+			// Current packet queued, swap buffers
+			if (!next) {
+				if (recvd >= len) return 0;
+				continue;
+			}
+			cur ^= 1;
+			SlipSplitFrameAppendStart(pkt[cur], next);
+			pend = next;
+			next = 0;
+		}
+		// Restart timeout each time the UART makes progress
+		if (pend != prev) {
+			prev = pend;
+			start = TimerMsGet();
+		}
+	}
+
+	return 1;
+}
+
+/************************************************************************//**
+ * \brief Programs an image to the WiFi module flash. Flash region is erased
+ *        and result reported to host. Then image is received from host and
+ *        written in ESP_BL_FLASH_BLOCK_LEN blocks. If a block fails, the
+ *        remaining data is received and discarded. If SF_WIFI_FLASH_DEFL
+ *        flag is set, image is sent compressed using deflate commands.
+ *
+ * \param[inout] data Buffer with the MDMA_WIFI_FLASH command. On return
+ *                    it holds the final status reply.
+ *
+ * \return Length of the reply.
+ ****************************************************************************/
+static uint16_t SfWiFiFlash(uint8_t data[]) {
+	uint8_t flags = data[1];
+	uint32_t addr = MDMA_DWORD_AT(data, 2);
+	uint32_t len = MDMA_DWORD_AT(data, 6);
+	uint8_t defl = flags & SF_WIFI_FLASH_DEFL;
+	uint32_t recvd;
+	uint32_t written = 0;
+	uint32_t seq = 0;
+	uint16_t fill;
+	uint8_t step;
+	uint8_t stat;
+
+	// Host must only send the image if erase succeeded
+	if (defl) {
+		// From now on, len holds the number of bytes to receive
+		stat = EspBlDeflBegin(addr, len, MDMA_DWORD_AT(data, 10));
+		len = MDMA_DWORD_AT(data, 10);
+	} else {
+		stat = EspBlFlashBegin(addr, len);
+	}
+	data[0] = stat?MDMA_ERR:MDMA_OK;
+	data[1] = stat;
+	SfDataSend(data, 2);
+	if (stat) return 0;
+
+	SfProgStart(MDMA_WIFI_FLASH);
+	for (recvd = 0; recvd < len;) {
+		// Fill a block with received USB packets
+		Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
+		for (fill = 0; fill < ESP_BL_FLASH_BLOCK_LEN && recvd < len;
+				fill += step, recvd += step) {
+			SfDataRecv(espBlk + fill);
+			step = MIN(VENDOR_O_EPSIZE, len - recvd);
+		}
+		// On abort, keep draining host data without sending it
+		if ((ESP_BL_OK == stat) && SfAbortPending()) stat = ESP_BL_ABORTED;
+		if (ESP_BL_OK == stat) {
+			stat = defl?EspBlDeflData(espBlk, fill, seq++):
+				EspBlFlashData(espBlk, fill, seq++);
+			if (ESP_BL_OK == stat) {
+				written += fill;
+				SfProgSet(written);
+			}
+		}
+	}
+	SfProgEnd();
+	if ((ESP_BL_OK == stat) && (flags & SF_WIFI_FLASH_END)) {
+		stat = defl?EspBlDeflEnd(flags & SF_WIFI_FLASH_REBOOT):
+			EspBlFlashEnd(flags & SF_WIFI_FLASH_REBOOT);
+	}
+
+	data[0] = stat?MDMA_ERR:MDMA_OK;
+	data[1] = stat;
+	SfUnalignDwordWrite(data + 2, written);
+	return 6;
+}
+
+/************************************************************************//**
+ * \brief Reads the WiFi module flash. Each data block sent by the stub is
+ *        relayed in an IN packet. If an error occurs, zero filled packets
+ *        are sent until the requested length is completed.
+ *
+ * \param[inout] data Buffer with the MDMA_WIFI_READ command. On return it
+ *                    holds the final status reply.
+ *
+ * \return Length of the reply.
+ ****************************************************************************/
+static uint16_t SfWiFiRead(uint8_t data[]) {
+	uint32_t len = MDMA_DWORD_AT(data, 5);
+	uint32_t total = 0;
+	uint32_t sent;
+	uint16_t step;
+	uint16_t recvd;
+	uint8_t stat;
+
+	stat = EspBlReadBegin(MDMA_DWORD_AT(data, 1), len, VENDOR_I_EPSIZE);
+	data[0] = stat?MDMA_ERR:MDMA_OK;
+	data[1] = stat;
+	SfDataSend(data, 2);
+	if (stat) return 0;
+
+	SfProgStart(MDMA_WIFI_READ);
+	for (sent = 0; sent < len; sent += step) {
+		SfProgSet(sent);
+		if (SfAbortPending()) {
+			SfProgEnd();
+			data[0] = MDMA_ERR;
+			data[1] = ESP_BL_ABORTED;
+			return 2;
+		}
+		step = MIN(VENDOR_I_EPSIZE, len - sent);
+		if (ESP_BL_OK == stat) {
+			stat = EspBlReadData(data, VENDOR_I_EPSIZE, &recvd, &total);
+			// Stub must send full blocks, excepting the last one
+			if ((ESP_BL_OK == stat) && (recvd != step)) stat = ESP_BL_ERR_STAT;
+		}
+		if (ESP_BL_OK != stat) memset(data, 0, step);
+		SfDataSend(data, step);
+	}
+	SfProgSet(sent);
+	SfProgEnd();
+	if (ESP_BL_OK == stat) stat = EspBlReadEnd(data + 2);
+
+	data[0] = stat?MDMA_ERR:MDMA_OK;
+	data[1] = stat;
+	return 2 + ESP_BL_MD5_LEN;
+}
+
+/************************************************************************//**
+ * \brief Receives a reply from the WiFi module, and sends it to the host as
+ *        it arrives, in as many IN packets as needed.
+ *
+ * \param[in] data Buffer used to build the IN packets.
+ ****************************************************************************/
+static void SfWiFiReplyStream(uint8_t data[]) {
+	uint8_t *payload = data + SF_WIFI_STREAM_HDR_LEN;
+	uint16_t len;
+	uint16_t stat;
+
+	stat = SlipFrameRecvPoll(payload, VENDOR_I_EPSIZE -
+			SF_WIFI_STREAM_HDR_LEN, &len, SF_WIFI_CMD_TOUT_MS);
+	while (TRUE) {
+		// Buffer full (2) is not an error, frame continues
+		data[0] = (stat && 2 != stat)?MDMA_ERR:MDMA_OK;
+		data[1] = len;
+		data[2] = (2 != stat);
+		SfDataSend(data, SF_WIFI_STREAM_HDR_LEN + len);
+		if (2 != stat) break;
+		stat = SlipFrameRecvNext(payload, VENDOR_I_EPSIZE -
+				SF_WIFI_STREAM_HDR_LEN, &len, SF_WIFI_CMD_TOUT_MS);
+	}
+}
+
+/************************************************************************//**
+ * \brief Sends the captured module output, in as many IN packets as
+ *        needed. Only characters already captured when the function is
+ *        called are sent.
+ *
+ * \param[in] data Buffer used to build the IN packets.
+ ****************************************************************************/
+static void SfWiFiLogSend(uint8_t data[]) {
+	uint8_t len;
+
+	SfCaptureTask();
+	do {
+		for (len = 0; len < (VENDOR_I_EPSIZE - SF_WIFI_STREAM_HDR_LEN) &&
+				cap.count; len++, cap.count--) {
+			data[SF_WIFI_STREAM_HDR_LEN + len] = espBlk[cap.head];
+			cap.head = (cap.head + 1) % ESP_BL_FLASH_BLOCK_LEN;
+		}
+		data[0] = MDMA_OK;
+		data[1] = len;
+		data[2] = !cap.count;
+		SfDataSend(data, SF_WIFI_STREAM_HDR_LEN + len);
+	} while (cap.count);
+}
+
 /************************************************************************//**
  * \brief Process a WiFi module related command.
  *
@@ -197,15 +827,34 @@ void SfGpioAction(uint8_t mask[], uint8_t r_w[], uint8_t value[], uint8_t readed
  *                    and the command reply once the function returns.
  ****************************************************************************/
 uint16_t SfWiFiCmdProc(uint8_t event, uint8_t data[]) {
+	WiFiBenchRes bench;
 	uint16_t len;
-	uint16_t sent;
 	uint16_t step;
 	uint8_t cmd;
+	uint8_t stat;
 
 	// Check we have a command request (because we received data).
 	if (SF_EVT_DIN != event) return 0;
 
-	UartFlush();
+	// While the CDC bridge owns the UART, only GPIO actions are allowed
+	if (CdcBridgeActive() && !((MDMA_WIFI_CTRL == MDMA_CMD(data)) &&
+				(data[1] <= SF_WIFI_CTRL_APP))) {
+		data[0] = MDMA_ERR;
+		return 1;
+	}
+
+	// Queued commands keep outstanding replies, other commands discard
+	// them. Capture related commands keep the captured output.
+	if ((MDMA_WIFI_CMD_QUEUE != MDMA_CMD(data)) &&
+			(MDMA_WIFI_REPLY_GET != MDMA_CMD(data)) &&
+			(MDMA_WIFI_LOG_GET != MDMA_CMD(data)) &&
+			!((MDMA_WIFI_CTRL == MDMA_CMD(data)) &&
+				(SF_WIFI_CTRL_LOG == data[1]))) {
+		WiFiCmdQInit();
+		// Keep the module output received so far
+		SfCaptureTask();
+		SlipFlush();
+	}
 	// Check which command we have in.
 	switch (MDMA_CMD(data)) {
 		case MDMA_WIFI_CMD:			// Forward command to the WiFi module
@@ -213,7 +862,7 @@ uint16_t SfWiFiCmdProc(uint8_t event, uint8_t data[]) {
 			cmd = data[5];
 			// Forward command to WiFi module and read response
 			if (SlipFrameSendPoll(data + SF_WIFI_CMD_PAYLOAD_OFF, len,
-					SF_WIFI_CMD_TOUT_CYCLES) != len) {
+					SF_WIFI_CMD_TOUT_MS) != len) {
 				data[0] = MDMA_ERR;
 				data[1] = 1;
 				return 2;
@@ -221,7 +870,7 @@ uint16_t SfWiFiCmdProc(uint8_t event, uint8_t data[]) {
 			// Read module response
 			for (step = 100; step; step--) {
 				if (!SlipFrameRecvPoll(data, VENDOR_O_EPSIZE, &len,
-							SF_WIFI_CMD_TOUT_CYCLES)) {
+							SF_WIFI_CMD_TOUT_MS)) {
 					if (1 == data[0] && data[1] == cmd) {
 						/// \todo FIXME should also check status and error
 						/// fields (offsets 8 and 9).
@@ -233,42 +882,85 @@ uint16_t SfWiFiCmdProc(uint8_t event, uint8_t data[]) {
 			}
 			return 2;
 
+		case MDMA_WIFI_CMD_QUEUE:	// Send command, reply is obtained later
+			len = data[1];
+			data[1] = WiFiCmdQSend(data + SF_WIFI_CMD_PAYLOAD_OFF, len,
+					SF_WIFI_CMD_TOUT_MS);
+			data[0] = data[1]?MDMA_ERR:MDMA_OK;
+			data[2] = WiFiCmdQPending();
+			return 3;
+
+		case MDMA_WIFI_REPLY_GET:	// Get reply to a queued command
+			// Reply frame is copied to data, so status must not
+			// overwrite it on success
+			stat = WiFiCmdQRecv(data[1], data, &len, SF_WIFI_CMDQ_TRIES,
+					SF_WIFI_CMD_TOUT_MS);
+			if (stat) {
+				data[0] = MDMA_ERR;
+				data[1] = stat;
+				return 2;
+			}
+			data[0] = MDMA_OK;
+			return len;
+
+		case MDMA_WIFI_LOG_GET:		// Send captured module output
+			SfWiFiLogSend(data);
+			return 0;
+
 		case MDMA_WIFI_CMD_LONG:	// Forward long command to WiFi module
 			len = data[1] | (data[2]<<8);
 			// Forward split long command to WiFi module and read response.
 			// Data is received split in several bulk transfers until
 			// completion
-			SlipSplitFrameSendSof(SF_WIFI_CMD_TOUT_CYCLES);
-			Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
-			for (sent = 0; sent < len; sent += step) {
-				SfDataRecv(data);
-				step = MIN(VENDOR_O_EPSIZE, len - sent);
-				if (SlipSplitFrameAppendPoll(data, step, SF_WIFI_CMD_TOUT_CYCLES) !=
-						step) {
-					data[0] = MDMA_ERR;
-					return 1;
-				}
+			if (SfWiFiLongFwd(data, len)) {
+				data[0] = MDMA_ERR;
+				return 1;
 			}
-			SlipSplitFrameSendEof(SF_WIFI_CMD_TOUT_CYCLES);
+			SlipSplitFrameSendEof(SF_WIFI_CMD_TOUT_MS);
 			// Completed, receive module response
 			if (SlipFrameRecvPoll(data, VENDOR_O_EPSIZE, &len,
-						SF_WIFI_CMD_TOUT_CYCLES)) {
+						SF_WIFI_CMD_TOUT_MS)) {
 				data[0] = MDMA_ERR;
 				return 1;
 			}
 			return len;	// OK!
 
+		case MDMA_WIFI_CMD_STREAM:	// Long command with streamed reply
+			len = data[1] | (data[2]<<8);
+			if (SfWiFiLongFwd(data, len)) {
+				data[0] = MDMA_ERR;
+				data[1] = 0;
+				data[2] = TRUE;
+				return SF_WIFI_STREAM_HDR_LEN;
+			}
+			SlipSplitFrameSendEof(SF_WIFI_CMD_TOUT_MS);
+			SfWiFiReplyStream(data);
+			return 0;
+
+		case MDMA_WIFI_FLASH:		// Program WiFi module flash
+			// espBlk holds the captured output while capture is enabled
+			if (UartCaptureOn()) {
+				data[0] = MDMA_ERR;
+				return 1;
+			}
+			return SfWiFiFlash(data);
+
+		case MDMA_WIFI_READ:		// Read WiFi module flash
+			return SfWiFiRead(data);
+
 		case MDMA_WIFI_CTRL:		// WiFi module control using GPIO
 			// Execute control action
 			switch (data[1]) {
 				case SF_WIFI_CTRL_RST:
 					// Put module in reset
 					WiFiReset();
+					EspBlInit();
 					break;
 
 				case SF_WIFI_CTRL_RUN:
 					// Release reset
 					WiFiStart();
+					EspBlInit();
 					break;
 
 				case SF_WIFI_CTRL_BLOAD:
@@ -283,28 +975,89 @@ uint16_t SfWiFiCmdProc(uint8_t event, uint8_t data[]) {
 
 				case SF_WIFI_CTRL_SYNC:
 					// Send the SYNC frame and try reading the response
-					// until success or too many attemps.
-					for (step = data[2]; step; step--) {
-						UartFlush();
-						SlipFrameSendPoll((uint8_t*)syncFrame,
-								sizeof(syncFrame),
-								SF_WIFI_CMD_TOUT_CYCLES);
-						while(!UartTxFifoEmpty());
-						if (!SlipFrameRecvPoll(data, VENDOR_O_EPSIZE,
-									&len, SF_WIFI_CMD_TOUT_CYCLES)) {
-							// Check we received the sync response
-							if (1 == data[0] && 8 == data[1]) {
-								data[0] = MDMA_OK;
-								return 1;
-							}
-						}
-						// Avoid USB timing out
-						USB_USBTask();
-					}
-					// Retries completed before sync correct
-					data[0] = MDMA_ERR;
+					// until success, too many attemps or abort. Attempts
+					// are run by the SYNC task, that sends the reply.
+					SfTaskStart(SF_WIFI_MOD, MDMA_WIFI_CTRL);
+					task.length = data[2];
+					return 0;
+
+				case SF_WIFI_CTRL_BAUD:
+					// Change baud rate. Reply includes the baud rate in
+					// use after the operation.
+					data[0] = EspBlBaudChange(MDMA_DWORD_AT(data, 2))?
+						MDMA_ERR:MDMA_OK;
+					SfUnalignDwordWrite(data + 1, UartBaudGet());
+					return 5;
+
+				case SF_WIFI_CTRL_FLOW:
+					// Enable (data[2] != 0) or disable flow control
+					SlipFlowCtrlSet(data[2]?TRUE:FALSE);
 					break;
 
+				case SF_WIFI_CTRL_STUB:
+					// Upload stub, reply includes the bootloader status.
+					// espBlk holds the captured output while capture is
+					// enabled.
+					if (UartCaptureOn()) {
+						data[0] = MDMA_ERR;
+						return 1;
+					}
+					data[1] = EspBlStubRun(espBlk);
+					data[0] = data[1]?MDMA_ERR:MDMA_OK;
+					return 2;
+
+				case SF_WIFI_CTRL_MD5:
+					// Address and length, reply includes the digest
+					data[1] = EspBlMd5(MDMA_DWORD_AT(data, 2),
+							MDMA_DWORD_AT(data, 6), data + 2);
+					data[0] = data[1]?MDMA_ERR:MDMA_OK;
+					return 2 + ESP_BL_MD5_LEN;
+
+				case SF_WIFI_CTRL_BOOT:
+					// SYNC tries and baud rate (0 to keep default). Reply
+					// includes status and the baud rate in use.
+					data[1] = EspBlBoot(data[2], MDMA_DWORD_AT(data, 3));
+					data[0] = data[1]?MDMA_ERR:MDMA_OK;
+					SfUnalignDwordWrite(data + 2, UartBaudGet());
+					return 6;
+
+				case SF_WIFI_CTRL_LOG:
+					// Enable (data[2] != 0) or disable capture. Reply
+					// includes the characters lost since last time, in
+					// the UART and in the capture buffer.
+					SfCaptureTask();
+					len = UartCaptureDropped();
+					len = (UINT16_MAX - len < cap.dropped)?UINT16_MAX:
+						len + cap.dropped;
+					SfUnalignWordWrite(data + 1, len);
+					// Captured output is kept only if capture goes on
+					if (!data[2] || !UartCaptureOn()) cap.count = 0;
+					cap.dropped = 0;
+					UartCaptureSet(data[2]?TRUE:FALSE);
+					data[0] = MDMA_OK;
+					return 3;
+
+				case SF_WIFI_CTRL_BENCH:
+					// Baud rate (4 bytes), block length and number of
+					// blocks (2 bytes each). Reply includes echoed bytes,
+					// elapsed milliseconds, errors and drops (4 bytes
+					// each).
+					data[0] = WiFiBench(MDMA_DWORD_AT(data, 2),
+							MDMA_WORD_AT(data, 6), MDMA_WORD_AT(data, 8),
+							&bench)?MDMA_ERR:MDMA_OK;
+					SfUnalignDwordWrite(data + 1, bench.bytes);
+					SfUnalignDwordWrite(data + 5, bench.ms);
+					SfUnalignDwordWrite(data + 9, bench.errors);
+					SfUnalignDwordWrite(data + 13, bench.drops);
+					return 17;
+
+				case SF_WIFI_CTRL_ERASE:
+					// Erase address and length (0 to erase whole chip)
+					data[1] = EspBlErase(MDMA_DWORD_AT(data, 2),
+							MDMA_DWORD_AT(data, 6));
+					data[0] = data[1]?MDMA_ERR:MDMA_OK;
+					return 2;
+
 				default:
 					// Unsupported!!!
 					data[0] = MDMA_ERR;
@@ -335,9 +1088,6 @@ uint16_t SfCmdProc(uint8_t data[]) {
 	uint16_t i;
 	uint32_t addr;
 	uint8_t port[SF_GPIO_NUM_PORTS];
-	uint16_t length;
-	uint8_t toWrite, written;
-	uint16_t step;
 	uint32_t dwLength;
 
 	switch (MDMA_CMD(data)) {
@@ -356,69 +1106,40 @@ uint16_t SfCmdProc(uint8_t data[]) {
 
 		case MDMA_READ:			// Flash read
 			// Save address and length
-			addr = MDMA_ADDR(data);
-			length = MDMA_LENGTH(data);
-			// Send OK
+			task.addr = MDMA_ADDR(data);
+			task.length = MDMA_LENGTH(data);
+			// Send OK, data is sent by the read task
 			data[0] = MDMA_OK;
 			SfDataSend(data, 1);
-			// Data send loop
-			while (length) {
-				step = MIN(length, VENDOR_I_EPSIZE>>1);
-				for (i = 0; i < step; i++, addr++)
-					((uint16_t*)data)[i] = FlashRead(addr);
-				length -= step;
-				SfDataSend(data, step<<1);
-			}
+			SfTaskStart(SF_CART_READ, MDMA_READ);
 			repLen = 0;
 			break;
 
 		case MDMA_CART_ERASE:	// Complete flash erase
-			data[0] = FlashChipErase()?MDMA_OK:MDMA_ERR;
-			repLen = 1;
+			// Start erase, the erase task sends the reply when finished
+			UartPumpPause();
+			FlashChipEraseStart();
+			UartPumpResume();
+			SfTaskStart(SF_CART_ERASE, MDMA_CART_ERASE);
+			repLen = 0;
 			break;
 
 		case MDMA_SECT_ERASE:	// Complete flash sector erase
+			UartPumpPause();
 			data[0] = FlashSectErase(MDMA_DWORD_AT(data,1))?
 				MDMA_OK:MDMA_ERR;
+			UartPumpResume();
 			repLen = 1;
 			break;
 
 		case MDMA_WRITE:		// Flash write
 			// Save address and length
-			addr = MDMA_ADDR(data);
-			length = MDMA_LENGTH(data);
-			// Send OK
+			task.addr = MDMA_ADDR(data);
+			task.length = MDMA_LENGTH(data);
+			// Send OK, data is received by the write task
 			data[0] = MDMA_OK;
 			SfDataSend(data, 1);
-			// Data write loop
-			Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
-			while (length)
-			{
-				// Read data
-				SfDataRecv(data);
-				// Data received on endpoint
-				step = MIN(length, VENDOR_O_EPSIZE>>1);
-				// Write data in blocks of max 16 words. The first
-				// write takes care of avoiding crossing a 16-word
-				// write-buffer boundary. Following writes are
-				// guaranteed not to cross it.
-				toWrite = MIN(step, 16 - (addr&0xF));
-				i = FlashWriteBuf(addr, (uint16_t*)data, toWrite);
-				if (i == toWrite) {
-					addr += i;
-					// First write is OK, write remaining data
-					while (i < step) {
-						toWrite = MIN(step - i, 16);
-						written = FlashWriteBuf(addr, ((uint16_t*)data) + i,
-								toWrite);
-						i += written;
-						addr += written;
-						// Check for errors
-						if (written != toWrite) break;
-					}
-				}
-				length -= i;
-			}
+			SfTaskStart(SF_CART_PROG, MDMA_WRITE);
 			repLen = 0;
 			break;
 
@@ -427,7 +1148,9 @@ uint16_t SfCmdProc(uint8_t data[]) {
 			if ((data[1] == 0x19) && (data[2] == 0x85) &&
 				(data[3] == 0xBA) && (data[4] == 0xDA) &&
 				(data[5] == 0x55)) {
+				UartPumpPause();
 				SfGpioAction(&data[6], &data[12], &data[18], port);
+				UartPumpResume();
 				repLen = 1 + SF_GPIO_NUM_PORTS;
 			} else {
 				// Incorrect magic bytes, return error
@@ -444,6 +1167,10 @@ uint16_t SfCmdProc(uint8_t data[]) {
 			si.sw &= ~SF_SW_EVENT;
 			break;
 
+		case MDMA_LINK_STATS:	// Link error counters
+			repLen = SfLinkStatsGet(data);
+			break;
+
 		case MDMA_BOOTLOADER:	// Enter bootloader
 			JumpToBootloader();
 			// The function above does not return, but we assign a value
@@ -454,6 +1181,12 @@ uint16_t SfCmdProc(uint8_t data[]) {
 		case MDMA_WIFI_CMD:
 		case MDMA_WIFI_CMD_LONG:
 		case MDMA_WIFI_CTRL:
+		case MDMA_WIFI_FLASH:
+		case MDMA_WIFI_READ:
+		case MDMA_WIFI_CMD_STREAM:
+		case MDMA_WIFI_CMD_QUEUE:
+		case MDMA_WIFI_REPLY_GET:
+		case MDMA_WIFI_LOG_GET:
 			repLen = SfWiFiCmdProc(SF_EVT_DIN, data);
 			break;
 
@@ -463,7 +1196,9 @@ uint16_t SfCmdProc(uint8_t data[]) {
 			addr = MDMA_3BYTES_AT(data, 1);
 			dwLength = MDMA_DWORD_AT(data, 4);
 			// Issue erase command
+			UartPumpPause();
 			data[0] = FlashRangeErase(addr, dwLength)?MDMA_ERR:MDMA_OK;
+			UartPumpResume();
 			break;
 
 		default:
@@ -475,16 +1210,34 @@ uint16_t SfCmdProc(uint8_t data[]) {
 	return repLen;
 }
 
+/************************************************************************//**
+ * \brief State machine timer callback, posts a SF_EVT_TIMER event.
+ ****************************************************************************/
+static void SfTimerCb(TimerSwId id) {
+	(void)id;
+	SfEvtPost(SF_EVT_TIMER);
+}
+
+/************************************************************************//**
+ * \brief Starts the state machine timer (one-shot).
+ *
+ * \param[in] ms Milliseconds until the SF_EVT_TIMER event.
+ ****************************************************************************/
+static inline void SfTimerStart(uint16_t ms) {
+	TimerSwStart(TIMER_SW_FSM, ms, 0, SfTimerCb);
+}
+
 /************************************************************************//**
  * \brief Resets cartridge and starts timer to wait for chip ready.
  ****************************************************************************/
 void SfCartInit(void) {
+	// UART pump must not run while initializing the cart
+	UartPumpStop();
 	// Hold reset during at least 500 ns (4 cycles@8MHz)
 	CIF_CLR__RST;
 	_NOP();_NOP();_NOP();_NOP();
 	// Launch 1 ms timer to wait until chip is ready to accept commands
-	Timer1Config(TimerMsToCount(1));
-	Timer1Start();
+	SfTimerStart(1);
 	si.s = SF_CART_INIT;
 	// Remove reset condition from flash chip
 	CIF_SET__RST;
@@ -492,18 +1245,197 @@ void SfCartInit(void) {
 	_NOP();_NOP();_NOP();_NOP();
 	// Initialize UART
 	si.cart_err = UartInit();
+	EspBlInit();
 }
 
 /************************************************************************//**
  * \brief Puts cart pins at their default (idle bus) state.
  ****************************************************************************/
 void SfCartRemove(void) {
+	UartPumpStop();
+	TimerSwStop(TIMER_SW_FSM);
+	TimerSwStop(TIMER_SW_CIN);
+	TimerSwStop(TIMER_SW_LED);
 	CIF_CLR__RST;
 	CIF_SET__TIME;
 	FlashIdle();
 	si.s = SF_IDLE;
 }
 
+/************************************************************************//**
+ * \brief Cart detect sampling timer callback. Samples the cart detect line
+ * while in SF_STAB_WAIT state, restarting the stable window on changes.
+ * Once the line is stable, the cart is initialized (or removed).
+ *
+ * \param[in] id Timer identifier (TIMER_SW_CIN).
+ ****************************************************************************/
+static void SfCinSampleCb(TimerSwId id) {
+	if (SF_STAB_WAIT != si.s) {
+		TimerSwStop(id);
+		return;
+	}
+	if (CIF__CIN_GET != si.f.cart_in) {
+		si.f.cart_in = CIF__CIN_GET;
+		si.stab = TimerMsGet();
+	}
+	if (TimerMsElapsed(si.stab) < SF_CIN_STAB_MS) return;
+
+	// Line stable, check if cart is inserted and USB ready
+	TimerSwStop(id);
+	LEDs_TurnOffLEDs(LEDS_LED2);
+	if (si.f.cart_in && si.f.usb_ready) {
+		si.tries = SF_CART_INIT_TRIES;
+		SfCartInit();
+	} else {
+		SfCartRemove();
+	}
+}
+
+/************************************************************************//**
+ * \brief LED blink timer callback. Blinks the LEDs while in SF_WARN state,
+ * and goes to SF_READY once blinking finishes.
+ *
+ * \param[in] id Timer identifier (TIMER_SW_LED).
+ ****************************************************************************/
+static void SfLedBlinkCb(TimerSwId id) {
+	if (SF_WARN != si.s) {
+		TimerSwStop(id);
+		return;
+	}
+	si.cycle--;
+	if (si.cycle & 1) {
+		LEDs_TurnOnLEDs(LEDS_ALL_LEDS);
+	} else {
+		LEDs_TurnOffLEDs(LEDS_ALL_LEDS);
+	}
+	if (0 == si.cycle) {
+		TimerSwStop(id);
+		LEDs_TurnOnLEDs(LEDS_LED1);
+		si.s = SF_READY;
+	}
+}
+
+/************************************************************************//**
+ * \brief Posts an event, to be processed on next SfEvtDispatch() call. Can
+ * be called from interrupt context. Events are coalesced: posting an event
+ * already pending has no effect. Posting a cart removal discards a pending
+ * cart insertion, posting an USB detach or error discards a pending USB
+ * attach, and posting a button press or release discards a pending
+ * release or press, so only the latest state is processed.
+ *
+ * \param[in] evt Event to post.
+ ****************************************************************************/
+void SfEvtPost(uint8_t evt) {
+	uint16_t clr = 0;
+
+	if (evt >= SF_EVT_NUM) return;
+	if (SF_EVT_COUT == evt) clr = SF_EVT_BIT(SF_EVT_CIN);
+	else if ((SF_EVT_USB_DET == evt) || (SF_EVT_USB_ERR == evt))
+		clr = SF_EVT_BIT(SF_EVT_USB_ATT);
+	else if (SF_EVT_SW_PRESS == evt) clr = SF_EVT_BIT(SF_EVT_SW_REL);
+	else if (SF_EVT_SW_REL == evt) clr = SF_EVT_BIT(SF_EVT_SW_PRESS);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		evtPend = (evtPend & ~clr) | SF_EVT_BIT(evt);
+		evtTime[evt] = TimerMsGet();
+	}
+}
+
+/************************************************************************//**
+ * \brief Obtains the time an event was last posted.
+ *
+ * \param[in] evt Event to query.
+ *
+ * \return Millisecond clock value (see TimerMsGet()) at post time.
+ ****************************************************************************/
+uint16_t SfEvtTime(uint8_t evt) {
+	uint16_t t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		t = evtTime[evt];
+	}
+	return t;
+}
+
+/************************************************************************//**
+ * \brief Obtains the pending events mask.
+ ****************************************************************************/
+static inline uint16_t SfEvtPendGet(void) {
+	uint16_t pend;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		pend = evtPend;
+	}
+	return pend;
+}
+
+/************************************************************************//**
+ * \brief Runs the FSM for each pending event, highest priority first. Cart
+ * removal and USB detach events have the highest priority, and data
+ * reception the lowest. Must be called from the main loop.
+ ****************************************************************************/
+void SfEvtDispatch(void) {
+	uint16_t pend;
+	uint8_t i, evt;
+
+	while ((pend = SfEvtPendGet())) {
+		for (i = 0; !(pend & SF_EVT_BIT(evtPrio[i])); i++);
+		evt = evtPrio[i];
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			evtPend &= ~SF_EVT_BIT(evt);
+		}
+		SfFsmCycle(evt);
+	}
+}
+
+/************************************************************************//**
+ * \brief Checks if an event that must abort the running operation (cart
+ * removal, USB detach or error) is pending, or if host requested an abort.
+ * These are signalled from interrupt context, so they are noticed even if
+ * the main loop does not run. Long operations must call this function at
+ * safe points.
+ *
+ * \return TRUE if running operation must be aborted, FALSE otherwise.
+ ****************************************************************************/
+uint8_t SfAbortPending(void) {
+	if (SfHostAbort()) return TRUE;
+
+	return (SfEvtPendGet() & SF_EVT_ABORT_MASK) != 0;
+}
+
+/************************************************************************//**
+ * \brief Processes vendor control requests (MDMA_CTRL_ABORT and
+ * MDMA_CTRL_PROGRESS). Runs in interrupt context, from the USB control
+ * request event handler.
+ ****************************************************************************/
+void SfControlRequest(void) {
+	uint8_t rep[MDMA_CTRL_PROGRESS_LEN];
+
+	switch (USB_ControlRequest.bRequest) {
+		case MDMA_CTRL_ABORT:
+			if (USB_ControlRequest.bmRequestType != (REQDIR_HOSTTODEVICE |
+						REQTYPE_VENDOR | REQREC_DEVICE)) break;
+			Endpoint_ClearSETUP();
+			// Only abort if a long command is running. Chip erase cannot
+			// be interrupted.
+			if (prog.cmd && (MDMA_CART_ERASE != prog.cmd)) hostAbort = TRUE;
+			Endpoint_ClearStatusStage();
+			break;
+
+		case MDMA_CTRL_PROGRESS:
+			if (USB_ControlRequest.bmRequestType != (REQDIR_DEVICETOHOST |
+						REQTYPE_VENDOR | REQREC_DEVICE)) break;
+			rep[0] = prog.cmd;
+			rep[1] = prog.aborted;
+			SfUnalignDwordWrite(rep + 2, prog.done);
+			Endpoint_ClearSETUP();
+			Endpoint_Write_Control_Stream_LE(rep,
+					MIN(sizeof(rep), USB_ControlRequest.wLength));
+			Endpoint_ClearOUT();
+			break;
+	}
+}
+
 /************************************************************************//**
  * \brief Takes an incoming event and executes a cycle of the system FSM
  *
@@ -523,43 +1455,32 @@ void SfFsmCycle(uint8_t evt) {
 	// status here.
 	switch (evt) {
 		case SF_EVT_TIMER:
-			if (si.s == SF_STAB_WAIT) {
-				LEDs_TurnOffLEDs(LEDS_LED2);
-				// Check if cart is finally inserted and USB ready
-				if (si.f.cart_in && si.f.usb_ready) {
-					SfCartInit();
-				} else {
-					SfCartRemove();
-				}
-			} else if (si.s == SF_CART_INIT) {
+			if (si.s == SF_CART_INIT) {
 				// Reset finished, cart should be ready to accept commands.
 				// Obtain IDs.
 				si.fc.manId = FlashGetManId();
 				FlashGetDevId(si.fc.devId);
+				// If IDs cannot be read (cart not properly seated yet),
+				// reset the cart and try again.
+				if (SF_MANID_INVALID(si.fc.manId)) {
+					if (--si.tries) {
+						SfCartInit();
+						break;
+					}
+					si.cart_err = TRUE;
+				}
 				// If we got cart init error, blink LEDs as warning. else
 				// go to READY state
 				if (si.cart_err) {
 					si.s = SF_WARN;
 					si.cycle = 8;
-					Timer1Config(TimerMsToCount(125));
-					Timer1Start();
+					// Periodic timer, stopped once blinking finishes
+					TimerSwStart(TIMER_SW_LED, 125, 125, SfLedBlinkCb);
 					LEDs_TurnOffLEDs(LEDS_ALL_LEDS);
 				} else {
 					si.s = SF_READY;
-				}
-			} else if (SF_WARN == si.s) {
-				si.cycle--;
-				if (si.cycle & 1) {
-					LEDs_TurnOnLEDs(LEDS_ALL_LEDS);
-				} else {
-					LEDs_TurnOffLEDs(LEDS_ALL_LEDS);
-				}
-				if (0 == si.cycle) {
-					LEDs_TurnOnLEDs(LEDS_LED1);
-					si.s = SF_READY;
-				} else {
-					Timer1Config(TimerMsToCount(125));
-					Timer1Start();
+					// Flash IDs obtained, UART can now use the bus
+					UartPumpStart();
 				}
 			} else if (SF_WIFI_MOD  == si.s) {
 				// TODO: Call espcomm FSM or remove this block?
@@ -569,10 +1490,15 @@ void SfFsmCycle(uint8_t evt) {
 			si.f.cart_in = TRUE;
 			if (si.s == SF_IDLE) {
 				si.s = SF_STAB_WAIT;
-				// Launch 1 s debounce timer
-				Timer1Config(TimerMsToCount(1000));
-				Timer1Start();
+				// Sample cart detect line until stable, counting from the
+				// pin edge
+				si.stab = SfEvtTime(SF_EVT_CIN);
+				TimerSwStart(TIMER_SW_CIN, SF_CIN_SAMPLE_MS, SF_CIN_SAMPLE_MS,
+						SfCinSampleCb);
 				LEDs_TurnOnLEDs(LEDS_LED2);
+			} else if (si.s == SF_STAB_WAIT) {
+				// Bounce, restart stable window
+				si.stab = SfEvtTime(SF_EVT_CIN);
 			}
 			break;
 		case SF_EVT_COUT:			// Cartridge removed
@@ -580,12 +1506,16 @@ void SfFsmCycle(uint8_t evt) {
 			if (si.s != SF_STAB_WAIT) {
 				// Remove cart and return to IDLE state
 				SfCartRemove();
+			} else {
+				// Bounce, restart stable window
+				si.stab = SfEvtTime(SF_EVT_COUT);
 			}
 			break;
 		case SF_EVT_USB_ATT:		// USB attached and enumerated
 			si.f.usb_ready = TRUE;
 			// Check if cart is inserted and we are IDLE.
 			if (si.f.cart_in && si.s == SF_IDLE) {
+				si.tries = SF_CART_INIT_TRIES;
 				SfCartInit();
 			}
 			break;
@@ -597,7 +1527,10 @@ void SfFsmCycle(uint8_t evt) {
 			SfCartRemove();
 			break;
 		case SF_EVT_DIN:
-			// Get data from USB endpoint
+			LEDs_TurnOnLEDs(LEDMASK_USB_BUSY);
+			// Get data from USB endpoint. Other events might have been
+			// processed since data was detected, so select the endpoint.
+			Endpoint_SelectEndpoint(VENDOR_OUT_EPADDR);
 			SfDataRecv(buf);
 			// If status == SF_READY, parse command. Else reply with error.
 			// There is an exception with the bootloader command, that must
@@ -609,6 +1542,7 @@ void SfFsmCycle(uint8_t evt) {
 				repLen = 1;
 			}
 			if (repLen) SfDataSend(buf, repLen);
+			LEDs_TurnOffLEDs(LEDMASK_USB_BUSY);
 			break;
 		case SF_EVT_SW_PRESS:		// Button pressed event
 			si.sw = SF_SW_EVENT | SF_SW_PRESSED;
@@ -43,6 +43,66 @@
  *     * Data (length according to length parameter).
  *   + Reply: OK. On error, reply has two bytes: the error code and the
  *     number of written words.
+ * - MDMA_WIFI_FLASH: Programs an image to the WiFi module SPI flash, using
+ *   the ROM bootloader protocol.
+ *   + Extra data fields:
+ *     * Flags (1 byte, see SfWifiFlashFlags).
+ *     * Flash address (4 bytes).
+ *     * Image length (4 bytes).
+ *     * Compressed image length (4 bytes, only with SF_WIFI_FLASH_DEFL).
+ *   + Reply: OK or ERR plus bootloader status (1 byte), once the flash
+ *     region has been erased. On OK, host sends the raw (or compressed)
+ *     image using as many bulk transfers as needed. Then a second reply is
+ *     sent: OK or ERR, bootloader status (1 byte) and bytes written (4
+ *     bytes, compressed bytes if SF_WIFI_FLASH_DEFL is set).
+ *   + Compressed images require the flasher stub to be running (and thus
+ *     building with ESP_STUB).
+ * - MDMA_WIFI_CMD_STREAM: Forwards a long command to the WiFi module, and
+ *   streams the reply as it is received, allowing replies of any length.
+ *   + Extra data fields: same as MDMA_WIFI_CMD_LONG.
+ *   + Reply: as many packets as needed, each one containing OK or ERR,
+ *     payload length (1 byte), last packet flag (1 byte) and payload.
+ * - MDMA_WIFI_CMD_QUEUE: Sends a command to the WiFi module without
+ *   waiting for the reply. Up to WIFI_CMDQ_LEN commands can be outstanding.
+ *   + Extra data fields: same as MDMA_WIFI_CMD.
+ *   + Reply: OK or ERR, queue status (1 byte) and number of outstanding
+ *     commands (1 byte).
+ * - MDMA_WIFI_REPLY_GET: Obtains the reply to a queued command. Replies to
+ *   other outstanding commands received meanwhile are buffered.
+ *   + Extra data fields: command code (1 byte).
+ *   + Reply: OK plus the reply frame (first byte replaced by OK), or ERR
+ *     plus queue status (1 byte).
+ * - MDMA_WIFI_LOG_GET: Obtains the module output captured since last call.
+ *   Capture is enabled with the SF_WIFI_CTRL_LOG control action, that
+ *   replies OK plus the number of characters lost (2 bytes) since capture
+ *   was enabled or the action was last issued. Captured output is kept in a
+ *   buffer of ESP_BL_FLASH_BLOCK_LEN characters (the MDMA_WIFI_FLASH block
+ *   buffer, so MDMA_WIFI_FLASH and SF_WIFI_CTRL_STUB fail while capture is
+ *   enabled), filled from the main loop. Output received while other WiFi
+ *   commands run, or while queued commands are outstanding, is consumed by
+ *   those commands and not captured. Capture and the CDC bridge are
+ *   mutually exclusive:
+ *   capture cannot be enabled while the bridge is active, and the bridge
+ *   does not activate while capture is enabled.
+ *   + Extra data fields: none.
+ *   + Reply: as many packets as needed, with the same format used by
+ *     MDMA_WIFI_CMD_STREAM.
+ * - MDMA_LINK_STATS: Obtains link error counters, to locate throughput
+ *   problems.
+ *   + Extra data fields: clear flag (1 byte, counters are reset if not 0).
+ *   + Reply: OK plus the following counters (2 bytes each): UART overrun,
+ *     parity and framing errors, SLIP reception timeouts, buffer
+ *     overflows and decoding errors, SLIP transmission timeouts, USB IN
+ *     and OUT endpoint waits, and USB stream errors.
+ * - MDMA_WIFI_READ: Reads the WiFi module SPI flash (requires stub, and
+ *   thus building with ESP_STUB).
+ *   + Extra data fields:
+ *     * Flash address (4 bytes).
+ *     * Length (4 bytes).
+ *   + Reply: OK or ERR plus bootloader status (1 byte). On OK, data is
+ *     sent using as many bulk transfers as needed (zero filled if an error
+ *     occurs). Then a second reply is sent: OK or ERR, bootloader status
+ *     (1 byte) and MD5 digest of the read data (16 bytes).
  * - MDMA_MAN_CTRL: Manual lines control (dangerous!).
  *   + Extar data fields:
  *     * Hex data: 19 85 BA DA 55 (5 bytes).
@@ -77,28 +137,67 @@
 #define SF_EVT_DOUT		 8	///< Data sent to host
 #define SF_EVT_SW_PRESS	 9	///< Button pressed
 #define SF_EVT_SW_REL	10	///< Button released
+#define SF_EVT_NUM		11	///< Number of events
+/** \} */
+
+/// Obtains the bit used to flag a pending event
+#define SF_EVT_BIT(evt)		(1U<<(evt))
+
+/// Pending events that must preempt long operations
+#define SF_EVT_ABORT_MASK	(SF_EVT_BIT(SF_EVT_COUT) | \
+		SF_EVT_BIT(SF_EVT_USB_DET) | SF_EVT_BIT(SF_EVT_USB_ERR))
+
+/// Time the cart detect line must be stable before initializing the cart
+#define SF_CIN_STAB_MS		20
+/// Cart detect line sampling period while waiting for it to be stable
+#define SF_CIN_SAMPLE_MS	1
+/// Number of cart resets to try before giving up reading flash IDs
+#define SF_CART_INIT_TRIES	3
+/// Evaluates to TRUE if manufacturer ID could not be read (empty bus)
+#define SF_MANID_INVALID(id)	((0xFFFF == (id)) || (0 == (id)))
+
+/** \addtogroup sys_fsm SfWifiFlashFlags Flags for MDMA_WIFI_FLASH command.
+ *  \{ */
+#define SF_WIFI_FLASH_END		0x01	///< Send FLASH_END when finished.
+#define SF_WIFI_FLASH_REBOOT	0x02	///< Run application after FLASH_END.
+#define SF_WIFI_FLASH_DEFL		0x04	///< Image is zlib compressed.
 /** \} */
 
 /** \addtogroup sys_fsm SfWifiCtrlCode Control code for WiFi module operations.
+ *  Actions using the flasher stub need the firmware built with ESP_STUB
+ *  (see esp-bl.h). Otherwise they fail with ESP_BL_ERR_NO_STUB.
  *  \{ */
 typedef enum {
 	SF_WIFI_CTRL_RST = 0,	///< Hold chip in reset state.
 	SF_WIFI_CTRL_RUN,		///< Reset the chip.
 	SF_WIFI_CTRL_BLOAD,		///< Enter bootloader mode.
 	SF_WIFI_CTRL_APP,		///< Start application.
-	SF_WIFI_CTRL_SYNC		///< Perform a SYNC attemp.
+	SF_WIFI_CTRL_SYNC,		///< Perform a SYNC attemp.
+	SF_WIFI_CTRL_BAUD,		///< Change UART baud rate.
+	SF_WIFI_CTRL_FLOW,		///< Enable/disable RTS/CTS flow control.
+	SF_WIFI_CTRL_STUB,		///< Upload and run the flasher stub (ESP_STUB).
+	SF_WIFI_CTRL_ERASE,		///< Erase flash region (stub, ESP_STUB).
+	SF_WIFI_CTRL_MD5,		///< Flash region MD5 digest (stub, ESP_STUB).
+	SF_WIFI_CTRL_BOOT,		///< Reset into bootloader, sync, set baud.
+	SF_WIFI_CTRL_LOG,		///< Enable/disable module output capture.
+	/// UART link benchmark. Only the local baud rate is changed: the peer
+	/// must already echo at the tested rate, or use a hardware loopback.
+	SF_WIFI_CTRL_BENCH
 } SfWifiCtrlCode;
 /** \} */
 
 /// Offset for the data payloa of the WiFi command
 #define SF_WIFI_CMD_PAYLOAD_OFF		4
 
-/// Maximum number of poll cycles for the UART before timing out
-#define SF_WIFI_TOUT_CYCLES_MAX		UINT16_MAX
+/// Header length of the packets of a streamed WiFi reply: status, payload
+/// length and last packet flag.
+#define SF_WIFI_STREAM_HDR_LEN		3
+
+/// Timeout for WiFi command UART operations, in milliseconds.
+#define SF_WIFI_CMD_TOUT_MS			250
 
-/// Number of UART poll cycles for WiFi command operations.
-//#define SF_WIFI_CMD_TOUT_CYCLES		SF_WIFI_TOUT_CYCLES_MAX
-#define SF_WIFI_CMD_TOUT_CYCLES		10000
+/// Frame reception attempts when waiting for a queued command reply
+#define SF_WIFI_CMDQ_TRIES			100
 
 /** \addtogroup sys_fsm SfSwData Pushbutton data interpretation masks.
  *  \{ */
@@ -159,6 +258,8 @@ typedef struct {
 	uint8_t sw;		///< Switch (pushbutton) status
 	uint8_t cart_err;
 	uint8_t cycle;
+	uint16_t stab;	///< Time cart detect line was last seen changing
+	uint8_t tries;	///< Cart reset tries left to read flash IDs
 } SfInstance;
 /** \} */
 
@@ -183,8 +284,70 @@ void SfInit(void);
  ****************************************************************************/
 void SfFsmCycle(uint8_t evt);
 
-/// Returns TRUE if a SF_EVT_TIMER event must be noticed to the FSM
-#define SfEvtTimerNotify()	Timer1Ovfw()
+/************************************************************************//**
+ * \brief Posts an event, to be processed on next SfEvtDispatch() call. Can
+ * be called from interrupt context. Events are coalesced: posting an event
+ * already pending has no effect. Posting a cart removal discards a pending
+ * cart insertion, posting an USB detach or error discards a pending USB
+ * attach, and posting a button press or release discards a pending
+ * release or press, so only the latest state is processed.
+ *
+ * \param[in] evt Event to post.
+ ****************************************************************************/
+void SfEvtPost(uint8_t evt);
+
+/************************************************************************//**
+ * \brief Runs the FSM for each pending event, highest priority first. Cart
+ * removal and USB detach events have the highest priority, and data
+ * reception the lowest. Must be called from the main loop.
+ ****************************************************************************/
+void SfEvtDispatch(void);
+
+/************************************************************************//**
+ * \brief Obtains the time an event was last posted.
+ *
+ * \param[in] evt Event to query.
+ *
+ * \return Millisecond clock value (see TimerMsGet()) at post time.
+ ****************************************************************************/
+uint16_t SfEvtTime(uint8_t evt);
+
+/************************************************************************//**
+ * \brief Checks if an event that must abort the running operation (cart
+ * removal, USB detach or error) is pending. These events are posted from
+ * interrupt context, so they are noticed even if the main loop does not
+ * run. Long operations must call this function at safe points.
+ *
+ * \return TRUE if running operation must be aborted, FALSE otherwise.
+ ****************************************************************************/
+uint8_t SfAbortPending(void);
+
+/************************************************************************//**
+ * \brief Processes vendor control requests (MDMA_CTRL_ABORT and
+ * MDMA_CTRL_PROGRESS). Runs in interrupt context, from the USB control
+ * request event handler.
+ ****************************************************************************/
+void SfControlRequest(void);
+
+/************************************************************************//**
+ * \brief Runs a step of the active long command task (if any). Must be
+ *        called from the main loop.
+ ****************************************************************************/
+void SfTaskStep(void);
+
+/************************************************************************//**
+ * \brief Checks if a long command task is running. While running, host
+ *        data must not be processed as commands.
+ *
+ * \return TRUE if a task is running, FALSE otherwise.
+ ****************************************************************************/
+uint8_t SfTaskBusy(void);
+
+/************************************************************************//**
+ * \brief Moves module output received by the UART to the capture buffer,
+ *        while capture is enabled. Must be called from the main loop.
+ ****************************************************************************/
+void SfCaptureTask(void);
 
 #endif /*_SYS_FSM_H_*/
 
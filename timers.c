@@ -1,52 +1,182 @@
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "timers.h"
 
-/// Computed count for Timer 0 to overflow
-static uint16_t t1load;
+/// Millisecond clock, incremented by Timer3
+static volatile uint32_t msCount;
+
+/// Software timer data
+typedef struct {
+	uint16_t remaining;	///< Milliseconds until expiration, 0 if stopped.
+	uint16_t period;	///< Reload value, 0 for one-shot timers.
+	TimerSwCb cb;		///< Expiration callback.
+} TimerSw;
+
+/// Software timers
+static TimerSw tsw[TIMER_SW_NUM];
+
+/// Millisecond clock value at last TimerSwTask() call
+static uint16_t tswLast;
 
 /************************************************************************//**
- * \brief Configures Timer 0 to generate overflow interrupt once elapsed
- * count timer 0 cycles. Prescaler is hardcoded to clkio/1024.
+ * \brief Configures and starts Timer0 to generate a periodic compare match
+ * interrupt (TIMER0_COMPA_vect) each count timer cycles. Prescaler is
+ * hardcoded to clkio/8.
  *
- * \param[in]	count	Number of timer cycles to count before interrupting.
+ * \param[in]	count	Number of timer cycles between interrupts (1 to 256).
  ****************************************************************************/
-void Timer1Config(uint16_t count) {
-	TCCR1B = 0x00;		// Ensure timer is stopped
-	// Compute count
-	t1load = (0xFFFFU - count) + 1;
+void Timer0PeriodicStart(uint16_t count) {
+	TCCR0B = 0x00;		// Ensure timer is stopped
+	TCNT0 = 0;
+	OCR0A = count - 1;
+	TCCR0A = (1<<WGM01);	// CTC mode, TOP = OCR0A
+	TIFR0 |= (1<<OCF0A);	// Clear compare match interrupt flag
+	Timer0IntEnable();
+	TCCR0B = (1<<CS01);		// Start timer, prescaler: 1/8
 }
 
 /************************************************************************//**
- * \brief Starts timer 0.
+ * \brief Stops Timer0 and disables its compare match interrupt.
  ****************************************************************************/
-void Timer1Start(void) {
-	TCCR1B = 0x00;		// Stop timer
-	TIFR1 |= (1<<TOV1);	// Clear overflow interrupt flag
-	// Load computed count value, high byte first
-	TCNT1H = t1load>>8;
-	TCNT1L = t1load & 0xFF;
-	TCCR1B = 0x05;		// Start timer, prescaler: 1/1024
+void Timer0Stop(void) {
+	TCCR0B = 0x00;
+	Timer0IntDisable();
 }
 
 /************************************************************************//**
- * \brief Stops timer 0.
+ * \brief Returns TRUE if a Timer0 compare match has occurred since last
+ * call, clearing the condition. Only meaningful while the compare match
+ * interrupt is disabled (otherwise the ISR clears the flag).
+ *
+ * \return TRUE if a compare match occurred, FALSE otherwise.
  ****************************************************************************/
-void Timer1Stop(void) {
-	TCCR1B = 0x00;
+uint8_t Timer0Match(void) {
+	if (TIFR0 & (1<<OCF0A)) {
+		TIFR0 |= (1<<OCF0A);
+		return TRUE;
+	} else return FALSE;
 }
 
+/************************************************************************//**
+ * \brief Starts Timer3 as a millisecond clock. A compare match interrupt
+ * (TIMER3_COMPA_vect) is generated each millisecond, incrementing the
+ * counter returned by TimerMsGet(). Prescaler is hardcoded to clkio/64.
+ ****************************************************************************/
+void TimerMsStart(void) {
+	TCCR3B = 0x00;		// Ensure timer is stopped
+	TCCR3A = 0x00;
+	TCNT3 = 0;
+	OCR3A = (F_CPU/64/1000) - 1;
+	msCount = 0;
+	tswLast = 0;
+	TIFR3 |= (1<<OCF3A);	// Clear compare match interrupt flag
+	TIMSK3 |= (1<<OCIE3A);
+	// CTC mode, TOP = OCR3A. Start timer, prescaler: 1/64
+	TCCR3B = (1<<WGM32) | (1<<CS31) | (1<<CS30);
+}
 
 /************************************************************************//**
- * \brief Returns TRUE if Timer1 Has overflowed, FALSE otherwise.
+ * \brief Obtains the millisecond clock count. The count wraps each 65536
+ * milliseconds, so it must only be used to measure intervals.
  *
- * \return TRUE if Timer1 overflow condition occurred, false otherwise.
+ * \return Milliseconds elapsed since TimerMsStart() was called.
  ****************************************************************************/
-uint8_t Timer1Ovfw(void) {
-	if (TIFR1 & (1<<TOV1)) {
-		// Stop timer, clear interrupt flag and return
-		Timer1Stop();
-		TIFR1 |= (1<<TOV1);
-		return TRUE;
-	} else return FALSE;
+uint16_t TimerMsGet(void) {
+	uint16_t ms;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ms = msCount;
+	}
+	return ms;
+}
+
+/************************************************************************//**
+ * \brief Obtains the 32-bit millisecond clock count. Wraps after about 49
+ * days, so for practical purposes it is a monotonic clock.
+ *
+ * \return Milliseconds elapsed since TimerMsStart() was called.
+ ****************************************************************************/
+uint32_t TimerUptimeGet(void) {
+	uint32_t ms;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ms = msCount;
+	}
+	return ms;
+}
+
+/************************************************************************//**
+ * \brief Starts (or restarts) a software timer.
+ *
+ * \param[in]	id		Timer to start.
+ * \param[in]	ms		Milliseconds until first expiration (at least 1).
+ * \param[in]	period	Milliseconds between following expirations. If 0,
+ *						the timer is one-shot.
+ * \param[in]	cb		Function to call each time the timer expires.
+ ****************************************************************************/
+void TimerSwStart(TimerSwId id, uint16_t ms, uint16_t period, TimerSwCb cb) {
+	// Elapsed time is accounted from the last TimerSwTask() call, so
+	// compensate the time elapsed since then.
+	tsw[id].remaining = MAX(ms, 1) + TimerMsElapsed(tswLast);
+	tsw[id].period = period;
+	tsw[id].cb = cb;
+}
+
+/************************************************************************//**
+ * \brief Stops a software timer. Its callback will not be called.
+ *
+ * \param[in]	id	Timer to stop.
+ ****************************************************************************/
+void TimerSwStop(TimerSwId id) {
+	tsw[id].remaining = 0;
+}
+
+/************************************************************************//**
+ * \brief Checks if a software timer is running.
+ *
+ * \param[in]	id	Timer to check.
+ *
+ * \return TRUE if timer is running, FALSE otherwise.
+ ****************************************************************************/
+uint8_t TimerSwActive(TimerSwId id) {
+	return tsw[id].remaining?TRUE:FALSE;
+}
+
+/************************************************************************//**
+ * \brief Advances the software timers, calling the callbacks of the
+ * expired ones. Must be periodically called from the main loop. Calls
+ * can be delayed (e.g. by blocking operations): elapsed time is computed
+ * from the millisecond clock, so expired timers always run their callback.
+ * If a periodic timer expired several times since the previous call, the
+ * callback runs only once, but the timer keeps its original phase.
+ ****************************************************************************/
+void TimerSwTask(void) {
+	uint16_t now = TimerMsGet();
+	uint16_t elapsed = now - tswLast;
+	uint16_t late;
+	uint8_t i;
+
+	if (!elapsed) return;
+	tswLast = now;
+
+	for (i = 0; i < TIMER_SW_NUM; i++) {
+		if (!tsw[i].remaining) continue;
+		if (tsw[i].remaining > elapsed) {
+			tsw[i].remaining -= elapsed;
+			continue;
+		}
+		// Timer expired. Reload before calling the callback, so it can
+		// restart or stop the timer. Periodic timers discount the time
+		// elapsed since expiration, to keep their phase.
+		late = elapsed - tsw[i].remaining;
+		tsw[i].remaining = tsw[i].period?
+			(tsw[i].period - (late % tsw[i].period)):0;
+		tsw[i].cb((TimerSwId)i);
+	}
+}
+
+/// Millisecond clock tick
+ISR(TIMER3_COMPA_vect) {
+	msCount++;
 }
 
@@ -1,40 +1,144 @@
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
 #include <stdint.h>
 #include <avr/io.h>
 #include "util.h" 	// Just for TRUE/FALSE defines
 
 
 /************************************************************************//**
- * \brief Obtains the count for Timer to elapse required ms.
+ * \brief Obtains the count for Timer0 compare match to elapse required us.
+ *
+ * \param[in]	us Microseconds to convert to Timer0 count.
+ *
+ * \note Uses a 1/8 prescaler to compute value. Maximum is 256 counts.
+ ****************************************************************************/
+#define Timer0UsToCount(us)	((uint16_t)((us)*(F_CPU/1000000)/8))
+
+/************************************************************************//**
+ * \brief Configures and starts Timer0 to generate a periodic compare match
+ * interrupt (TIMER0_COMPA_vect) each count timer cycles. Prescaler is
+ * hardcoded to clkio/8.
+ *
+ * \param[in]	count	Number of timer cycles between interrupts (1 to 256).
+ *
+ * \note Timer0 is reserved for the UART pump (see 16c550 module).
+ ****************************************************************************/
+void Timer0PeriodicStart(uint16_t count);
+
+/************************************************************************//**
+ * \brief Stops Timer0 and disables its compare match interrupt.
+ ****************************************************************************/
+void Timer0Stop(void);
+
+/************************************************************************//**
+ * \brief Enables the Timer0 compare match interrupt.
+ ****************************************************************************/
+#define Timer0IntEnable()	do{TIMSK0 |= (1<<OCIE0A);}while(0)
+
+/************************************************************************//**
+ * \brief Disables the Timer0 compare match interrupt. Timer keeps running.
+ ****************************************************************************/
+#define Timer0IntDisable()	do{TIMSK0 &= ~(1<<OCIE0A);}while(0)
+
+/************************************************************************//**
+ * \brief Returns TRUE if a Timer0 compare match has occurred since last
+ * call, clearing the condition. Only meaningful while the compare match
+ * interrupt is disabled (otherwise the ISR clears the flag).
+ *
+ * \return TRUE if a compare match occurred, FALSE otherwise.
+ ****************************************************************************/
+uint8_t Timer0Match(void);
+
+/************************************************************************//**
+ * \brief Starts Timer3 as a millisecond clock. A compare match interrupt
+ * (TIMER3_COMPA_vect) is generated each millisecond, incrementing the
+ * counter returned by TimerMsGet(). Prescaler is hardcoded to clkio/64.
+ *
+ * \note Timer3 is reserved for the millisecond clock.
+ ****************************************************************************/
+void TimerMsStart(void);
+
+/************************************************************************//**
+ * \brief Obtains the millisecond clock count. The count wraps each 65536
+ * milliseconds, so it must only be used to measure intervals.
+ *
+ * \return Milliseconds elapsed since TimerMsStart() was called.
+ ****************************************************************************/
+uint16_t TimerMsGet(void);
+
+/************************************************************************//**
+ * \brief Obtains the milliseconds elapsed since a TimerMsGet() call.
+ *
+ * \param[in]	start	Value returned by TimerMsGet() at interval start.
  *
- * \param[in]	ms Milliseconds to convert to Timer1 count.
+ * \return Milliseconds elapsed since start (up to 65535).
+ ****************************************************************************/
+#define TimerMsElapsed(start)	((uint16_t)(TimerMsGet() - (start)))
+
+/************************************************************************//**
+ * \brief Obtains the 32-bit millisecond clock count. Wraps after about 49
+ * days, so for practical purposes it is a monotonic clock.
  *
- * \note Uses a 1/1024 prescaler to compute value.
- * \warning Computation might silently overflow!
+ * \return Milliseconds elapsed since TimerMsStart() was called.
  ****************************************************************************/
-#define TimerMsToCount(ms)	((uint16_t)((ms)*(F_CPU/1000)/1024))
+uint32_t TimerUptimeGet(void);
+
+/** \addtogroup TimerSwId Software timer identifiers. Add new timers
+ *  before TIMER_SW_NUM.
+ *  \{ */
+typedef enum {
+	TIMER_SW_FSM = 0,	///< System state machine timer (cart reset).
+	TIMER_SW_CIN,		///< Cart detect line sampling.
+	TIMER_SW_LED,		///< LED warning blink.
+	TIMER_SW_NUM		///< Number of software timers.
+} TimerSwId;
+/** \} */
 
 /************************************************************************//**
- * \brief Configures Timer 0 to generate overflow once elapsed
- * count timer 0 cycles. Prescaler is hardcoded to clkio/1024.
+ * \brief Software timer expiration callback. Runs from TimerSwTask(),
+ * i.e. in main loop context.
  *
- * \param[in]	count	Number of timer cycles to count before overflow.
+ * \param[in]	id	Identifier of the expired timer.
  ****************************************************************************/
-void Timer1Config(uint16_t count);
+typedef void (*TimerSwCb)(TimerSwId id);
 
 /************************************************************************//**
- * \brief Starts timer 0.
+ * \brief Starts (or restarts) a software timer.
+ *
+ * \param[in]	id		Timer to start.
+ * \param[in]	ms		Milliseconds until first expiration (at least 1).
+ * \param[in]	period	Milliseconds between following expirations. If 0,
+ *						the timer is one-shot.
+ * \param[in]	cb		Function to call each time the timer expires.
  ****************************************************************************/
-void Timer1Start(void);
+void TimerSwStart(TimerSwId id, uint16_t ms, uint16_t period, TimerSwCb cb);
 
 /************************************************************************//**
- * \brief Stops timer 0.
+ * \brief Stops a software timer. Its callback will not be called.
+ *
+ * \param[in]	id	Timer to stop.
  ****************************************************************************/
-void Timer1Stop(void);
+void TimerSwStop(TimerSwId id);
 
 /************************************************************************//**
- * \brief Returns TRUE if Timer1 Has overflowed, FALSE otherwise.
+ * \brief Checks if a software timer is running.
  *
- * \return TRUE if Timer1 overflow condition occurred, false otherwise.
+ * \param[in]	id	Timer to check.
+ *
+ * \return TRUE if timer is running, FALSE otherwise.
  ****************************************************************************/
-uint8_t Timer1Ovfw(void);
+uint8_t TimerSwActive(TimerSwId id);
+
+/************************************************************************//**
+ * \brief Advances the software timers, calling the callbacks of the
+ * expired ones. Must be periodically called from the main loop. Calls
+ * can be delayed (e.g. by blocking operations): elapsed time is computed
+ * from the millisecond clock, so expired timers always run their callback.
+ * If a periodic timer expired several times since the previous call, the
+ * callback runs only once, but the timer keeps its original phase.
+ ****************************************************************************/
+void TimerSwTask(void);
+
+#endif /*_TIMERS_H_*/
 
@@ -21,6 +21,9 @@
 #define MIN(a, b)	((a)<(b)?(a):(b))
 #endif
 
+/// Increments an unsigned counter, saturating at its maximum value
+#define SatInc(cnt)	do{if ((typeof(cnt))((cnt) + 1)) (cnt)++;}while(0)
+
 /// Prints to the error output stream, using printf formatting.
 #define eprintf(...)	do{fprintf(stderr, __VA_ARGS__);} while(0)
 
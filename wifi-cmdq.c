@@ -0,0 +1,156 @@
+/************************************************************************//**
+ * \file
+ * \brief Queue of outstanding WiFi module commands. Several commands can be
+ * sent back to back, without waiting for their replies. Replies are matched
+ * to outstanding commands by their command code, and replies received while
+ * waiting for another command are buffered until requested.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ ****************************************************************************/
+
+#include "wifi-cmdq.h"
+#include "slip.h"
+#include "util.h"
+#include <string.h>
+#include <LUFA/Drivers/USB/USB.h>
+
+/// Buffered reply frame
+typedef struct {
+	uint8_t len;						///< Frame length (0 if free).
+	uint8_t frame[WIFI_CMDQ_FRAME_MAX];	///< Frame data.
+} WiFiCmdQSlot;
+
+/// Codes of the outstanding commands
+static uint8_t pend[WIFI_CMDQ_LEN];
+/// Number of outstanding commands
+static uint8_t pendNum;
+/// Buffered replies
+static WiFiCmdQSlot slot[WIFI_CMDQ_SLOTS];
+
+/************************************************************************//**
+ * \brief Discards all outstanding commands and buffered replies. Must be
+ *        called each time the WiFi module or the UART are reset.
+ ****************************************************************************/
+void WiFiCmdQInit(void) {
+	uint8_t i;
+
+	pendNum = 0;
+	for (i = 0; i < WIFI_CMDQ_SLOTS; i++) slot[i].len = 0;
+}
+
+/************************************************************************//**
+ * \brief Looks for an outstanding command.
+ *
+ * \param[in] cmd Command code.
+ *
+ * \return Position of the command in the outstanding list, or
+ *         WIFI_CMDQ_LEN if not found.
+ ****************************************************************************/
+static uint8_t WiFiCmdQPendFind(uint8_t cmd) {
+	uint8_t i;
+
+	for (i = 0; i < pendNum && pend[i] != cmd; i++);
+	return pendNum == i?WIFI_CMDQ_LEN:i;
+}
+
+/************************************************************************//**
+ * \brief Removes an outstanding command, keeping the order of the others.
+ *
+ * \param[in] pos Position of the command in the outstanding list.
+ ****************************************************************************/
+static void WiFiCmdQPendRemove(uint8_t pos) {
+	pendNum--;
+	for (; pos < pendNum; pos++) pend[pos] = pend[pos + 1];
+}
+
+/************************************************************************//**
+ * \brief Sends a command, and adds it to the outstanding command list.
+ *
+ * \param[in] data      Command frame.
+ * \param[in] len       Length of the command frame.
+ * \param[in] toutMs    Send timeout in milliseconds.
+ *
+ * \return WIFI_CMDQ_OK if command was sent, WIFI_CMDQ_FULL if there are
+ *         too many outstanding commands, or WIFI_CMDQ_ERR_TX if command
+ *         could not be sent.
+ ****************************************************************************/
+uint8_t WiFiCmdQSend(uint8_t data[], uint16_t len, uint16_t toutMs) {
+	if (WIFI_CMDQ_LEN == pendNum) return WIFI_CMDQ_FULL;
+	if (len <= WIFI_CMDQ_CMD_OFF) return WIFI_CMDQ_ERR_TX;
+
+	if (SlipFrameSendPoll(data, len, toutMs) != len)
+		return WIFI_CMDQ_ERR_TX;
+	pend[pendNum++] = data[WIFI_CMDQ_CMD_OFF];
+
+	return WIFI_CMDQ_OK;
+}
+
+/************************************************************************//**
+ * \brief Obtains the reply to an outstanding command. If the reply was
+ *        already buffered, it is returned immediately. Otherwise frames are
+ *        received until the reply arrives, buffering the replies to other
+ *        outstanding commands, and dropping unexpected frames.
+ *
+ * \param[in]  cmd       Code of the command to get the reply to.
+ * \param[out] data      Buffer receiving the reply frame (must be at least
+ *                       WIFI_CMDQ_FRAME_MAX bytes long).
+ * \param[out] length    Length of the reply frame.
+ * \param[in]  tries     Number of frame reception attempts.
+ * \param[in]  toutMs    Timeout of each attempt, in milliseconds.
+ *
+ * \return WIFI_CMDQ_OK if reply was obtained, WIFI_CMDQ_NOT_PEND if there
+ *         is no outstanding command with the requested code, or
+ *         WIFI_CMDQ_TIMEOUT if reply was not received.
+ ****************************************************************************/
+uint8_t WiFiCmdQRecv(uint8_t cmd, uint8_t data[], uint16_t *length,
+		uint8_t tries, uint16_t toutMs) {
+	uint8_t pos, i;
+
+	if (WIFI_CMDQ_LEN == (pos = WiFiCmdQPendFind(cmd)))
+		return WIFI_CMDQ_NOT_PEND;
+
+	// Check if reply has already been received
+	for (i = 0; i < WIFI_CMDQ_SLOTS; i++) {
+		if (slot[i].len && slot[i].frame[WIFI_CMDQ_CMD_OFF] == cmd) {
+			*length = slot[i].len;
+			memcpy(data, slot[i].frame, slot[i].len);
+			slot[i].len = 0;
+			WiFiCmdQPendRemove(pos);
+			return WIFI_CMDQ_OK;
+		}
+	}
+
+	for (; tries; tries--) {
+		if (SlipFrameRecvPoll(data, WIFI_CMDQ_FRAME_MAX, length, toutMs) ||
+				(*length <= WIFI_CMDQ_CMD_OFF) ||
+				(WIFI_CMDQ_DIR_REPLY != data[WIFI_CMDQ_DIR_OFF])) {
+			// Avoid USB timing out
+			USB_USBTask();
+			continue;
+		}
+		if (data[WIFI_CMDQ_CMD_OFF] == cmd) {
+			WiFiCmdQPendRemove(pos);
+			return WIFI_CMDQ_OK;
+		}
+		// Reply to another command. Buffer it if the command is
+		// outstanding, and there is room for it.
+		if (WIFI_CMDQ_LEN != WiFiCmdQPendFind(data[WIFI_CMDQ_CMD_OFF])) {
+			for (i = 0; i < WIFI_CMDQ_SLOTS && slot[i].len; i++);
+			if (i < WIFI_CMDQ_SLOTS) {
+				memcpy(slot[i].frame, data, *length);
+				slot[i].len = *length;
+			}
+		}
+	}
+
+	return WIFI_CMDQ_TIMEOUT;
+}
+
+/************************************************************************//**
+ * \brief Returns the number of outstanding commands.
+ ****************************************************************************/
+uint8_t WiFiCmdQPending(void) {
+	return pendNum;
+}
+
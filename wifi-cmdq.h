@@ -0,0 +1,95 @@
+/************************************************************************//**
+ * \file
+ * \brief Queue of outstanding WiFi module commands. Several commands can be
+ * sent back to back, without waiting for their replies. Replies are matched
+ * to outstanding commands by their command code, and replies received while
+ * waiting for another command are buffered until requested.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2016
+ * \defgroup wifi-cmdq WiFi module outstanding command queue.
+ * \{
+ ****************************************************************************/
+
+#ifndef _WIFI_CMDQ_H_
+#define _WIFI_CMDQ_H_
+
+#include <stdint.h>
+
+/// Maximum number of outstanding commands
+#define WIFI_CMDQ_LEN			4
+
+/// Number of unmatched replies that can be buffered
+#define WIFI_CMDQ_SLOTS			4
+
+/// Maximum length of a buffered reply frame
+#define WIFI_CMDQ_FRAME_MAX		64
+
+/// Offset of the direction byte in command and reply frames
+#define WIFI_CMDQ_DIR_OFF		0
+
+/// Offset of the command code in command and reply frames
+#define WIFI_CMDQ_CMD_OFF		1
+
+/// Direction byte value for reply frames
+#define WIFI_CMDQ_DIR_REPLY		1
+
+/** \addtogroup wifi-cmdq WiFiCmdQStat Status codes returned by the module.
+ *  \{ */
+enum {
+	WIFI_CMDQ_OK = 0,		///< Success.
+	WIFI_CMDQ_FULL,			///< Too many outstanding commands.
+	WIFI_CMDQ_ERR_TX,		///< Command could not be sent.
+	WIFI_CMDQ_NOT_PEND,		///< No outstanding command with that code.
+	WIFI_CMDQ_TIMEOUT		///< Reply was not received.
+};
+/** \} */
+
+/************************************************************************//**
+ * \brief Discards all outstanding commands and buffered replies. Must be
+ *        called each time the WiFi module or the UART are reset.
+ ****************************************************************************/
+void WiFiCmdQInit(void);
+
+/************************************************************************//**
+ * \brief Sends a command, and adds it to the outstanding command list.
+ *
+ * \param[in] data      Command frame.
+ * \param[in] len       Length of the command frame.
+ * \param[in] toutMs    Send timeout in milliseconds.
+ *
+ * \return WIFI_CMDQ_OK if command was sent, WIFI_CMDQ_FULL if there are
+ *         too many outstanding commands, or WIFI_CMDQ_ERR_TX if command
+ *         could not be sent.
+ ****************************************************************************/
+uint8_t WiFiCmdQSend(uint8_t data[], uint16_t len, uint16_t toutMs);
+
+/************************************************************************//**
+ * \brief Obtains the reply to an outstanding command. If the reply was
+ *        already buffered, it is returned immediately. Otherwise frames are
+ *        received until the reply arrives, buffering the replies to other
+ *        outstanding commands, and dropping unexpected frames.
+ *
+ * \param[in]  cmd       Code of the command to get the reply to.
+ * \param[out] data      Buffer receiving the reply frame (must be at least
+ *                       WIFI_CMDQ_FRAME_MAX bytes long).
+ * \param[out] length    Length of the reply frame.
+ * \param[in]  tries     Number of frame reception attempts.
+ * \param[in]  toutMs    Timeout of each attempt, in milliseconds.
+ *
+ * \return WIFI_CMDQ_OK if reply was obtained, WIFI_CMDQ_NOT_PEND if there
+ *         is no outstanding command with the requested code, or
+ *         WIFI_CMDQ_TIMEOUT if reply was not received.
+ ****************************************************************************/
+uint8_t WiFiCmdQRecv(uint8_t cmd, uint8_t data[], uint16_t *length,
+		uint8_t tries, uint16_t toutMs);
+
+/************************************************************************//**
+ * \brief Returns the number of outstanding commands.
+ ****************************************************************************/
+uint8_t WiFiCmdQPending(void);
+
+#endif /*_WIFI_CMDQ_H_*/
+
+/** \} */
+
@@ -8,10 +8,9 @@
  ****************************************************************************/
 #include "wifi-if.h"
 #include "slip.h"
+#include "timers.h"
 #include "util.h"
-#include <LUFA/Drivers/Board/LEDs.h>
-
-#define TEST_CHR	"0123456789ABCDEF"
+#include <string.h>
 
 /************************************************************************//**
  * \brief Initializes WiFi interface. Must be called once before any other
@@ -37,15 +36,14 @@ void WiFiInit(void) {
  ****************************************************************************/
 uint16_t WiFiPollSend(uint8_t data[], uint16_t dataLen) {
 	uint16_t i;
-	uint8_t j;
 
 	for (i = 0; i < dataLen;) {
-		// Wait until FIFO empty, and send in bursts of up to 16 characters.
-		while (!UartTxFifoEmpty());
-		for (j = 0; j < 16 && i < dataLen; i++, j++) {
-			UartPutchar(data[i]);
-		}
+		// Queue characters while there is room in the TX ring, and pump
+		// the UART when full.
+		if (RingFull(&uartTxRing)) UartPump();
+		else RingPut(&uartTxRing, data[i++]);
 	}
+	UartPump();
 
 	return i;
 }
@@ -62,47 +60,96 @@ uint16_t WiFiPollSend(uint8_t data[], uint16_t dataLen) {
 uint16_t WiFiPollRecv(uint8_t data[], uint16_t dataLen) {
 	uint16_t i;
 
-	for (i = 0; i < dataLen; i++) {
-		// Wait until there's data on FIFO
-		while (!UartRxFifoData());
-		data[i]  = UartGetchar();
+	for (i = 0; i < dataLen;) {
+		// Get characters from the RX ring, and pump the UART when empty.
+		if (RingEmpty(&uartRxRing)) UartPump();
+		else data[i++] = RingGet(&uartRxRing);
 	}
 
 	return i;
 }
 
-void WiFiSendTest(void) {
-	// Uart Write Test
-	while (TRUE) {
-		// Wait until FIFO empty
-		while (!UartTxFifoEmpty());
-		// FIFO empty, load 16 characters
-		int i;
-		for (i = 0; i < 16; i++) UartPutchar(TEST_CHR[i]);
-	}
-}
+/************************************************************************//**
+ * \brief Measures UART link quality. A pattern is sent in blocks to a peer
+ *        echoing received characters (e.g. a loopback plug, or the module
+ *        running an echo application), and echoed characters are checked.
+ *        Only the local UART baud rate is changed, so the peer must already
+ *        use the tested baud rate. Previous baud rate is restored when
+ *        finished.
+ *
+ * \param[in]  baud   Baud rate to test.
+ * \param[in]  blkLen Length of each block.
+ * \param[in]  blocks Number of blocks to send.
+ * \param[out] res    Benchmark results.
+ *
+ * \return WIFI_BENCH_OK if all blocks were echoed (even with errors),
+ *         WIFI_BENCH_ERR_PARAM if baud rate is not supported or length is
+ *         0, or WIFI_BENCH_TIMEOUT if the peer stopped echoing.
+ ****************************************************************************/
+uint8_t WiFiBench(uint32_t baud, uint16_t blkLen, uint16_t blocks,
+		WiFiBenchRes *res) {
+	uint32_t prev = UartBaudGet();
+	uint8_t stat = WIFI_BENCH_OK;
+	uint16_t tx, rx;
+	uint16_t start, last;
+	uint8_t c, skip, pend;
 
-void WiFiEchoTest(void) {
-	uint8_t c = 0;
+	memset(res, 0, sizeof(WiFiBenchRes));
+	if (!blkLen || UartBaudSet(baud)) return WIFI_BENCH_ERR_PARAM;
+	UartFlush();
 
-	while (TRUE) {
-		// Wait until FIFO empty and write char
-		while (!UartTxFifoEmpty());
-		UartPutchar(c);
-		// Waitn until char is echoed and compare with sent
-		while (!UartRxFifoData());
-		if (c != UartGetchar()) {
-			// Received character does not match!
-			LEDs_TurnOffLEDs(LEDS_LED2);
-			LEDs_ToggleLEDs(LEDS_LED1);
+	for (; blocks && WIFI_BENCH_OK == stat; blocks--) {
+		// Send and check the block at the same time. Pattern is the
+		// position in the block, so lost bytes are detected. Late echoes
+		// from the previous block are discarded.
+		UartFlush();
+		start = last = TimerMsGet();
+		for (tx = rx = pend = 0; rx < blkLen;) {
+			if (tx < blkLen && !RingFull(&uartTxRing)) {
+				RingPut(&uartTxRing, tx++);
+			}
+			if (!RingEmpty(&uartRxRing)) {
+				c = RingGet(&uartRxRing);
+				res->bytes++;
+				last = TimerMsGet();
+				// Previous byte did not match. If it matched a later
+				// sent byte (pend positions ahead) and this byte follows
+				// it, previous bytes were dropped. Otherwise previous
+				// byte was wrong.
+				if (pend) {
+					skip = pend;
+					pend = 0;
+					if ((c == (uint8_t)(rx + skip)) && ((rx + skip) < tx)) {
+						res->drops += skip;
+						rx += skip + 1;
+						continue;
+					}
+					res->errors++;
+				}
+				skip = c - (uint8_t)rx;
+				// Mismatch can be a wrong byte or a drop: wait for the
+				// next byte to decide, keeping position meanwhile.
+				if (skip && (skip < WIFI_BENCH_RESYNC) &&
+						((rx + skip) < tx)) pend = skip;
+				else if (skip) res->errors++;
+				rx++;
+			} else if (TimerMsElapsed(last) >= WIFI_BENCH_TOUT_MS) {
+				// If something was echoed, the end of the block was
+				// dropped. Otherwise the peer is not echoing.
+				if (!rx) stat = WIFI_BENCH_TIMEOUT;
+				else res->drops += blkLen - rx;
+				break;
+			}
+			UartPump();
 		}
-		c++;
+		// Undecided mismatch at block end counts as an error
+		if (pend) res->errors++;
+		res->ms += TimerMsElapsed(start);
 	}
-}
 
-void WiFiEchoServerTest(void) {
-	while (TRUE) {
-		while (!UartRxFifoData());
-		UartPutchar(UartGetchar());
-	}
+	UartBaudSet(prev);
+	UartFlush();
+
+	return stat;
 }
+
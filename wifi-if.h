@@ -15,12 +15,31 @@
 
 #include "16c550.h"
 
-/*
- * Test functions. To be deleted when hardware tests finish.
- */
-void WiFiSendTest(void);
-void WiFiEchoTest(void);
-void WiFiEchoServerTest(void);
+/// Time without echoed characters before aborting a benchmark, in ms.
+#define WIFI_BENCH_TOUT_MS		100
+
+/// Maximum number of consecutive dropped characters detected as drops by
+/// the benchmark. Longer gaps are counted as errors.
+#define WIFI_BENCH_RESYNC		16
+
+/** \addtogroup wifi-if WiFiBenchStat Benchmark status codes.
+ *  \{ */
+enum {
+	WIFI_BENCH_OK = 0,		///< Benchmark completed.
+	WIFI_BENCH_ERR_PARAM,	///< Invalid parameter.
+	WIFI_BENCH_TIMEOUT		///< Peer stopped echoing characters.
+};
+/** \} */
+
+/** \addtogroup wifi-if WiFiBenchRes Benchmark results.
+ *  \{ */
+typedef struct {
+	uint32_t bytes;		///< Bytes echoed back.
+	uint32_t ms;		///< Elapsed time, in milliseconds.
+	uint32_t errors;	///< Echoed bytes not matching the sent ones.
+	uint32_t drops;		///< Sent bytes not echoed back.
+} WiFiBenchRes;
+/** \} */
 
 /************************************************************************//**
  * \brief Initializes WiFi interface. Must be called once before any other
@@ -73,14 +92,14 @@ void WiFiInit(void);
  *
  * \return 0 if pin active, non-zero otherwise.
  ****************************************************************************/
-#define WiFiCtsGet()		do{UartCtsGet();}while(0)
+#define WiFiCtsGet()		UartCtsGet()
 
 /************************************************************************//**
  * \brief Obtains the #DATA (active low) pin status.
  *
  * \return 0 if pin active, non-zero otherwise.
  ****************************************************************************/
-#define WiFiDataGet()		do{UartDsrGet();}while(0)
+#define WiFiDataGet()		UartDsrGet()
 
 /************************************************************************//**
  * \brief Sends an array of characters using polling method.
@@ -104,6 +123,26 @@ uint16_t WiFiPollSend(uint8_t data[], uint16_t dataLen);
  ****************************************************************************/
 uint16_t WiFiPollRecv(uint8_t data[], uint16_t dataLen);
 
+/************************************************************************//**
+ * \brief Measures UART link quality. A pattern is sent in blocks to a peer
+ *        echoing received characters (e.g. a loopback plug, or the module
+ *        running an echo application), and echoed characters are checked.
+ *        Only the local UART baud rate is changed, so the peer must already
+ *        use the tested baud rate. Previous baud rate is restored when
+ *        finished.
+ *
+ * \param[in]  baud   Baud rate to test.
+ * \param[in]  blkLen Length of each block.
+ * \param[in]  blocks Number of blocks to send.
+ * \param[out] res    Benchmark results.
+ *
+ * \return WIFI_BENCH_OK if all blocks were echoed (even with errors),
+ *         WIFI_BENCH_ERR_PARAM if baud rate is not supported or length is
+ *         0, or WIFI_BENCH_TIMEOUT if the peer stopped echoing.
+ ****************************************************************************/
+uint8_t WiFiBench(uint32_t baud, uint16_t blkLen, uint16_t blocks,
+		WiFiBenchRes *res);
+
 #endif /*_WIFI_IF_H_*/
 
 /** \} */